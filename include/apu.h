@@ -0,0 +1,107 @@
+#ifndef DODO_APU_H_
+#define DODO_APU_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "blip_buffer.h"
+#include "hash.h"
+#include "save_state.h"
+
+// The APU is clocked at the same rate as the PPU, regardless of CPU speed
+const double kApuClockRate = 4194304;
+const double kDefaultSampleRate = 48000;
+
+// The sound hardware: two square channels (the first with a frequency sweep),
+// a wave channel and a noise channel, mixed to stereo.
+//
+// Nothing is stepped per cycle. The APU is run up to the present whenever its
+// registers are accessed, and within a run each channel only does work when
+// its waveform steps, which is added to band-limited buffers as a delta.
+class Apu {
+ public:
+  Apu();
+
+  // Advances by ticks and makes the audio up to there available to read
+  void run(int ticks);
+
+  uint8_t read(uint16_t addr) const;
+  void write(uint16_t addr, uint8_t data);
+
+  // With synthesis off, only the state games can observe (lengths,
+  // envelopes, sweep and status) advances, and nothing is mixed
+  void setSynthesis(bool enabled);
+  void setSampleRate(double sample_rate);
+
+  size_t samplesAvailable() const { return left.samplesAvailable(); }
+
+  // Reads up to max_frames interleaved stereo frames, returning how many
+  size_t readSamples(int16_t *out, size_t max_frames);
+
+  // Leaves out waveform positions, which only affect the synthesized audio
+  void hashState(Hasher &hasher) const;
+
+  // Saves everything but the audio already synthesized, so a loaded state
+  // plays on from the audio before it. Must be saved and loaded between runs.
+  void saveState(StateWriter &writer) const;
+  void loadState(StateReader &reader);
+
+ private:
+  // Each channel's output step in the buffers, at full volume
+  static constexpr int kAmplitude = 32;
+
+  // Registers $FF10-$FF3F, with wave RAM at the end
+  std::array<uint8_t, 0x30> regs;
+  bool power;
+  bool synthesis;
+
+  struct Channel {
+    bool enabled;  // Turned on by triggering, off by length, sweep or DAC
+    bool length_enabled;
+    uint16_t length;  // Clocks left until the channel turns off
+    uint8_t volume;
+    uint8_t envelope_timer;
+
+    // Synthesis only: ticks until the waveform next steps, and where it is
+    uint32_t timer;
+    uint8_t position;
+    uint16_t lfsr;
+
+    // What was last added to the buffers, so changes can be turned into steps
+    int left, right;
+  };
+  std::array<Channel, 4> channels;
+
+  // Channel 1's frequency sweep
+  uint16_t sweep_shadow;
+  uint8_t sweep_timer;
+  bool sweep_enabled;
+
+  // Lengths, sweep and envelopes are clocked every 8192 ticks in 8 steps
+  uint32_t sequencer_timer;
+  uint8_t sequencer_step;
+
+  uint32_t time;  // Ticks since the buffers' frame started
+  BlipBuffer left, right;
+
+  uint8_t reg(size_t channel, size_t n) const { return regs[5 * channel + n]; }
+  uint16_t frequency(size_t channel) const {
+    return static_cast<uint16_t>((reg(channel, 4) & 0b111) << 8) |
+           reg(channel, 3);
+  }
+  bool dacEnabled(size_t channel) const;
+  uint32_t period(size_t channel) const;
+
+  void trigger(size_t channel);
+  void clockSequencer();
+  void clockSweep();
+  uint16_t sweepTarget() const;
+
+  void runChannel(size_t channel, uint32_t from, uint32_t to);
+  int channelOutput(size_t channel) const;
+  void updateOutput(size_t channel, uint32_t at);
+  void updateOutputs(uint32_t at);
+};
+
+#endif  // DODO_APU_H_
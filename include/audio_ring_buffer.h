@@ -0,0 +1,65 @@
+#ifndef DODO_AUDIO_RING_BUFFER_H_
+#define DODO_AUDIO_RING_BUFFER_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// A lock-free single-producer/single-consumer ring of interleaved stereo
+// samples, for handing audio from the emulation thread to an audio callback.
+// Capacity is in stereo frames and must be a power of two. Neither side
+// blocks: the producer is told how much fit, and the consumer how much was
+// there.
+template <size_t Capacity>
+class AudioRingBuffer {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "AudioRingBuffer capacity must be a power of two");
+
+ public:
+  AudioRingBuffer() : samples(), head(0), tail(0) {}
+
+  // Producer side: writes up to n frames, returning how many fit
+  size_t write(const int16_t *in, size_t n) {
+    const uint64_t t = tail.load(std::memory_order_relaxed);
+    const uint64_t h = head.load(std::memory_order_acquire);
+    n = std::min<size_t>(n, Capacity - (t - h));
+    for (size_t i = 0; i < n; i++) {
+      const size_t slot = (t + i) & (Capacity - 1);
+      samples[2 * slot] = in[2 * i];
+      samples[2 * slot + 1] = in[2 * i + 1];
+    }
+    tail.store(t + n, std::memory_order_release);
+    return n;
+  }
+
+  // Consumer side: reads up to n frames, returning how many there were
+  size_t read(int16_t *out, size_t n) {
+    const uint64_t h = head.load(std::memory_order_relaxed);
+    const uint64_t t = tail.load(std::memory_order_acquire);
+    n = std::min<size_t>(n, t - h);
+    for (size_t i = 0; i < n; i++) {
+      const size_t slot = (h + i) & (Capacity - 1);
+      out[2 * i] = samples[2 * slot];
+      out[2 * i + 1] = samples[2 * slot + 1];
+    }
+    head.store(h + n, std::memory_order_release);
+    return n;
+  }
+
+  // Frames waiting to be read
+  size_t size() const {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
+  }
+  static constexpr size_t capacity() { return Capacity; }
+
+ private:
+  std::array<int16_t, 2 * Capacity> samples;
+
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+};
+
+#endif  // DODO_AUDIO_RING_BUFFER_H_
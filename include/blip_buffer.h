@@ -0,0 +1,60 @@
+#ifndef DODO_BLIP_BUFFER_H_
+#define DODO_BLIP_BUFFER_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Band-limited step synthesis. A waveform is described only by when it steps
+// and by how much, and each step is resampled to the output rate through a
+// windowed sinc kernel, so there's no per-clock work and no aliasing.
+//
+// Times are in input clocks since the end of the last frame. Samples become
+// available to read once endFrame is called for a time after them.
+class BlipBuffer {
+ public:
+  BlipBuffer(double clock_rate, double sample_rate, size_t capacity);
+
+  // May be changed between frames, e.g. to nudge the output rate
+  void setRates(double clock_rate, double sample_rate);
+
+  // Steps the waveform by delta at the given time. Steps that would overflow
+  // the buffer are dropped.
+  void addDelta(uint32_t time, int delta);
+
+  void endFrame(uint32_t time);
+
+  size_t samplesAvailable() const {
+    return offset >> kFracBits;
+  }
+  size_t getCapacity() const { return capacity; }
+
+  // Reads up to n samples into every stride'th element of out, returning how
+  // many were read. out may be null to skip samples.
+  size_t readSamples(int16_t *out, size_t n, size_t stride);
+  void removeSamples(size_t n);
+
+ private:
+  static constexpr int kFracBits = 32;    // Of sample positions
+  static constexpr int kPhaseBits = 6;    // Kernel phases per sample
+  static constexpr size_t kWidth = 16;    // Kernel taps
+  static constexpr int kKernelBits = 15;  // Fixed-point scale of the kernel
+  static constexpr int kBassShift = 9;    // Strength of DC removal
+
+  using Kernel = std::array<std::array<int32_t, kWidth>, 1 << kPhaseBits>;
+  static const Kernel &kernel();
+
+  // Discards the first n samples' deltas
+  void shift(size_t n);
+
+  size_t capacity;
+  uint64_t factor;  // Output samples per input clock, as 32.32 fixed point
+  uint64_t offset;  // Where the current frame starts, as 32.32 fixed point
+  int64_t integrator;
+
+  // Deltas at the output rate, which are summed up as samples are read
+  std::vector<int64_t> deltas;
+};
+
+#endif  // DODO_BLIP_BUFFER_H_
@@ -5,9 +5,14 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <vector>
 
+#include "apu.h"
 #include "mbc/mbc.h"
+#include "paged_memory.h"
 #include "ppu.h"
+#include "rtc_clock.h"
+#include "save_state.h"
 #include "timer.h"
 
 const size_t kWramSize = 0x8000;
@@ -21,12 +26,49 @@ const int kIntOffJoypad = 4;
 
 class Bus {
  public:
-  Bus() : wram(), hram(), ppu(), timer(), wram_bank(1) {}
+  Bus()
+      : wram(kWramSize),
+        hram(),
+        serial_temp(),
+        elapsed_dots(0),
+        rtc_clock(elapsed_dots),
+        ppu(),
+        timer(),
+        apu(),
+        apu_ticks_pending(0),
+        cpu_ticks_total(0),
+        ppu_ticks_pending(0),
+        ppu_ticks_until_event(0),
+        frame_ready(false),
+        int_enable(0),
+        int_request(0),
+        double_speed(false),
+        prepare_speed_switch(false),
+        cgb_mode(false),
+        wram_bank(1),
+        hdma_mode(HdmaMode::kHdmaNone),
+        hdma_src_dst(),
+        hdma_len(0),
+        hdma_src(0),
+        hdma_dst(0),
+        select_action_buttons(false),
+        select_dir_buttons(false),
+        action_buttons_pressed(0xF),
+        dir_buttons_pressed(0xF) {}
 
   // Returns true if there is a new frame ready
   bool tick(int cpu_tcycles);
 
-  void loadMbc(std::unique_ptr<Mbc> mbc_) { this->mbc = std::move(mbc_); }
+  // The new cartridge's clock starts from the host's time
+  void loadMbc(std::unique_ptr<Mbc> mbc_) {
+    this->mbc = std::move(mbc_);
+    rtc_clock.seedFromWallClock();
+    mbc->setRtcClock(&rtc_clock);
+  }
+
+  void detachSave() {
+    if (mbc) mbc->detachSave();
+  }
 
   void reset(bool cgb_mode);
 
@@ -61,20 +103,85 @@ class Bus {
 
   void oamdma(uint16_t addr);
 
-  const std::array<std::array<uint16_t, 160>, 144> &getFrame() const {
-    return ppu.getFrame();
+  const PublishedFrame &getFrame() { return ppu.getFrame(); }
+
+  void setRenderMode(RenderMode mode) { ppu.setRenderMode(mode); }
+  void finishRendering() { ppu.finishRendering(); }
+  void setFrameSkip(int frame_skip) { ppu.setFrameSkip(frame_skip); }
+  void setRenderingEnabled(bool enabled) { ppu.setRenderingEnabled(enabled); }
+  uint64_t getMismatchedFrames() const { return ppu.getMismatchedFrames(); }
+  uint64_t getFrameHash() const { return ppu.getFrameHash(); }
+
+  // Emulated time since power on, in dots, whatever the CPU speed
+  uint64_t getElapsedDots() const { return elapsed_dots; }
+
+  // The seed is part of the saved state, while the mode is a setting
+  void setRtcMode(RtcMode mode) { rtc_clock.mode = mode; }
+  uint64_t getRtcSeed() const { return rtc_clock.seed; }
+  void setRtcSeed(uint64_t seed) { rtc_clock.seed = seed; }
+
+  void setAudioEnabled(bool enabled) {
+    syncApu();
+    apu.setSynthesis(enabled);
+  }
+  void setAudioSampleRate(double sample_rate) {
+    syncApu();
+    apu.setSampleRate(sample_rate);
+  }
+  size_t readAudio(int16_t *out, size_t max_frames) {
+    return apu.readSamples(out, max_frames);
+  }
+
+  // Catches up the PPU first, so the hash doesn't depend on when it last ran
+  void hashState(Hasher &hasher);
+
+  // Just the cartridge's RAM and registers, which need no catching up
+  void hashCartridge(Hasher &hasher) const {
+    if (mbc) mbc->hashState(hasher);
   }
 
+  // Saving catches up every device first, like hashState, so a state never
+  // holds ticks that haven't been run yet
+  void saveState(StateWriter &writer);
+  void loadState(StateReader &reader);
+
+  // Takes on parent's state, sharing WRAM and cartridge RAM copy-on-write
+  // and copying the rest. Neither may be running while this happens.
+  void forkFrom(Bus &parent);
+
  private:
-  std::array<uint8_t, kWramSize> wram;
+  // Paged in its banks, so forks can share it
+  PagedMemory<0x1000> wram;
   std::array<uint8_t, kHramSize> hram;
   uint8_t serial_temp[2];
 
+  // Declared before the MBC, which reads the clock when it's destroyed
+  uint64_t elapsed_dots;
+  RtcClock rtc_clock;
+
   std::unique_ptr<Mbc> mbc;
 
   Ppu ppu;
   Timer timer;
 
+  // Like the PPU, the APU is only run when its registers are accessed, and
+  // once a frame so audio keeps flowing
+  Apu apu;
+  int apu_ticks_pending;
+  void syncApu();
+
+  // CPU ticks since power on, which the timer is derived from
+  uint64_t cpu_ticks_total;
+  void syncTimer();
+
+  // The PPU is only ticked when something could observe it: an access to
+  // its registers or memory, or the next point it may raise an interrupt
+  int ppu_ticks_pending;
+  int ppu_ticks_until_event;
+  bool frame_ready;  // Whether a catch-up since the last tick hit VBlank
+
+  void syncPpu();
+
   uint8_t int_enable, int_request;  // $FFFF IE and $FF0F IF
   bool double_speed, prepare_speed_switch;
   bool cgb_mode;
@@ -88,6 +195,12 @@ class Bus {
 
   bool select_action_buttons, select_dir_buttons;
   uint8_t action_buttons_pressed, dir_buttons_pressed;
+
+  // The state of everything but WRAM and the cartridge, which forking
+  // shares rather than copies
+  void saveDevices(StateWriter &writer) const;
+  void loadDevices(StateReader &reader);
+  std::vector<uint8_t> fork_state;
 };
 
 #endif  // DODO_BUS_H_
@@ -8,6 +8,8 @@
 
 #include "bus.h"
 #include "cpu_register.h"
+#include "hash.h"
+#include "save_state.h"
 
 const int kFlagOffZ = 7;
 const int kFlagOffN = 6;
@@ -24,6 +26,11 @@ class Cpu {
 
   void reset(bool cgb_mode);
 
+  void hashState(Hasher &hasher) const;
+
+  void saveState(StateWriter &writer) const;
+  void loadState(StateReader &reader);
+
  private:
   const std::shared_ptr<Bus> bus;
 
@@ -0,0 +1,78 @@
+#ifndef DODO_DEFERRED_RENDERER_H_
+#define DODO_DEFERRED_RENDERER_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "line_renderer.h"
+
+// Logs LineStates and VRAM/OAM writes during a frame, and draws the whole
+// frame at VBlank. The renderer keeps its own copy of VRAM and OAM that lags
+// behind the PPU's by one frame; replaying the write log brings it forward
+// line by line. Runs of lines with no writes between them see identical
+// memory, so each run is drawn in parallel on the shared ThreadPool.
+class DeferredRenderer {
+ public:
+  // Starts from a copy of the given memory
+  DeferredRenderer(const std::array<uint8_t, kVramSize> &vram_,
+                   const std::array<uint8_t, kOamSize> &oam_);
+
+  // Indices are offsets into VRAM/OAM, as opposed to bus addresses.
+  // Until a line is logged (e.g. during VBlank) nothing can observe the old
+  // values, so writes go straight to memory.
+  void writeVram(uint16_t index, uint8_t data) {
+    if (lines.empty()) {
+      vram[index] = data;
+    } else {
+      writes.push_back({index, data});
+    }
+  }
+  void writeOam(uint16_t index, uint8_t data) {
+    if (lines.empty()) {
+      oam[index] = data;
+      renderer.invalidateSprites();
+    } else {
+      writes.push_back({static_cast<uint16_t>(kOamFlag | index), data});
+    }
+  }
+
+  void drawLine(const LineState &state) {
+    lines.push_back({state, writes.size()});
+  }
+
+  // Draws the logged lines into frame, or just catches up on memory writes
+  // if render is false (e.g. for a skipped frame), then clears the logs
+  void endFrame(Frame &frame, bool render);
+
+  // Replaces the copy of VRAM and OAM, e.g. after a state is loaded, and
+  // drops anything logged
+  void reload(const std::array<uint8_t, kVramSize> &vram_,
+              const std::array<uint8_t, kOamSize> &oam_);
+
+ private:
+  static constexpr uint16_t kOamFlag = 0x8000;
+
+  struct MemoryWrite {
+    uint16_t index;  // kOamFlag is set for OAM writes
+    uint8_t data;
+  };
+
+  struct LoggedLine {
+    LineState state;
+    size_t writes_before;  // How many writes must be applied before drawing
+  };
+
+  std::array<uint8_t, kVramSize> vram;
+  std::array<uint8_t, kOamSize> oam;
+  LineRenderer renderer;
+
+  std::vector<MemoryWrite> writes;
+  std::vector<LoggedLine> lines;
+  size_t writes_applied;
+
+  void applyWrites(size_t writes_end);
+};
+
+#endif  // DODO_DEFERRED_RENDERER_H_
@@ -0,0 +1,51 @@
+#ifndef DODO_FRAME_DELTA_H_
+#define DODO_FRAME_DELTA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "frame_publisher.h"
+#include "line_renderer.h"
+
+// Frames are encoded for streaming as the runs of lines that changed since the
+// last frame encoded, so a static screen costs only the header.
+//
+// Format, all little-endian:
+//   u64 frame number, u8 number of runs
+//   Per run: u8 first line, u8 line count, then 160 BGR555 u16s per line
+
+class FrameDeltaEncoder {
+ public:
+  FrameDeltaEncoder() : last(), last_number(0) {}
+
+  // Appends the delta from the previously encoded frame to out.
+  // The first frame after construction or reset() is encoded in full.
+  void encode(const PublishedFrame &frame, std::vector<uint8_t> &out);
+
+  void reset() { last_number = 0; }
+
+ private:
+  Frame last;
+  uint64_t last_number;  // 0 if there is no previous frame
+};
+
+class FrameDeltaDecoder {
+ public:
+  FrameDeltaDecoder() : frame(), number(0) {}
+
+  // Applies one encoded delta, returning an error string if it's malformed.
+  // A malformed delta leaves the frame partially updated.
+  std::optional<std::string> apply(const uint8_t *data, size_t size);
+
+  const Frame &getFrame() const { return frame; }
+  uint64_t getFrameNumber() const { return number; }
+
+ private:
+  Frame frame;
+  uint64_t number;
+};
+
+#endif  // DODO_FRAME_DELTA_H_
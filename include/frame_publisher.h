@@ -0,0 +1,66 @@
+#ifndef DODO_FRAME_PUBLISHER_H_
+#define DODO_FRAME_PUBLISHER_H_
+
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+
+#include "hash.h"
+#include "line_renderer.h"
+#include "triple_buffer.h"
+
+// A completed frame as handed to consumers
+struct PublishedFrame {
+  Frame pixels;
+  uint64_t number;         // Counts published frames, starting at 1
+  std::bitset<144> dirty;  // Lines that differ from the previous frame
+  uint64_t hash;           // Hasher::hash of the pixels
+};
+
+// Hands completed frames from the renderer to a consumer thread.
+// The producer draws into getBack() and calls publish() once the frame is
+// complete, which works out which lines changed since the last frame and
+// hashes it.
+class FramePublisher {
+ public:
+  FramePublisher() : frames(), last(), number(0), last_hash(0) {}
+
+  // Producer side
+  Frame &getBack() { return frames.getBack().pixels; }
+  const Frame &getBack() const { return frames.getBack().pixels; }
+
+  void publish() {
+    PublishedFrame &back = frames.getBack();
+    back.number = ++number;
+    for (size_t y = 0; y < 144; y++) {
+      back.dirty[y] = back.pixels[y] != last[y];
+      if (back.dirty[y]) last[y] = back.pixels[y];
+    }
+    back.hash = Hasher::hash(back.pixels.data(), sizeof(back.pixels));
+    last_hash.store(back.hash, std::memory_order_release);
+    frames.publish();
+  }
+
+  // The hash of the last published frame. Unlike acquire, this doesn't
+  // disturb the consumer, so any thread may call it.
+  uint64_t getLastHash() const {
+    return last_hash.load(std::memory_order_acquire);
+  }
+
+  // Consumer side: returns the latest published frame
+  const PublishedFrame &acquire() {
+    frames.acquire();
+    return frames.getFront();
+  }
+
+ private:
+  TripleBuffer<PublishedFrame> frames;
+
+  // Only touched by the producer
+  Frame last;
+  uint64_t number;
+
+  std::atomic<uint64_t> last_hash;
+};
+
+#endif  // DODO_FRAME_PUBLISHER_H_
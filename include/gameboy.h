@@ -7,14 +7,16 @@
 #include <string>
 #include <string_view>
 #include <variant>
+#include <vector>
 
 #include "bus.h"
 #include "cpu.h"
 #include "mbc/mbc.h"
+#include "rom_image.h"
 
 class Gameboy {
  public:
-  Gameboy() : bus(std::make_shared<Bus>()), cpu(bus) {}
+  Gameboy() : bus(std::make_shared<Bus>()), cpu(bus), state_size(0) {}
 
   // Returns whether a new frame is ready
   bool step();
@@ -22,12 +24,19 @@ class Gameboy {
   // Attempts to laod a cartridge, returning an error string on failure.
   // This is atomic, so any failure to load the file or create the MBC
   // won't affect the system.
+  // The ROM comes from RomCache::shared(), so every Gameboy running the same
+  // cartridge shares one copy of it.
   std::optional<std::string> loadCartridge(std::string filename);
 
+  // Stops writing the cartridge's battery save, so that nothing from here on
+  // changes it, e.g. while replaying a movie. Anything pending is written
+  // first.
+  void detachSave() { bus->detachSave(); }
+
   // Either constructs an MBC of the given type, or returns a string error
   static std::variant<std::unique_ptr<Mbc>, std::string> makeMbc(
       std::string_view filename, uint8_t type, size_t ram_size,
-      const std::vector<uint8_t> &data);
+      std::shared_ptr<const RomImage> rom);
 
   // Bit 3  Down  or Start    (0=Pressed)
   // Bit 2  Up    or Select   (0=Pressed)
@@ -38,14 +47,102 @@ class Gameboy {
     bus->setButtonsPressed(action_buttons_pressed, dir_buttons_pressed);
   }
 
-  const std::array<std::array<uint16_t, 160>, 144> &getFrame() const {
-    return bus->getFrame();
+  // Returns the latest completed frame, with its number and the lines that
+  // changed since the frame before it. This may be called from a thread other
+  // than the one calling step, e.g. a presentation thread.
+  const PublishedFrame &getFrame() { return bus->getFrame(); }
+
+  void setRenderMode(RenderMode mode) { bus->setRenderMode(mode); }
+
+  // With a threaded render mode, frames are completed some time after step
+  // reports them. This blocks until the frame step last reported is ready.
+  void finishRendering() { bus->finishRendering(); }
+
+  // Only draw one out of every (frame_skip + 1) frames
+  void setFrameSkip(int frame_skip) { bus->setFrameSkip(frame_skip); }
+
+  // Frames run with rendering off aren't drawn or published, which saves
+  // most of the PPU's work. Only change this when step reports a frame.
+  void setRenderingEnabled(bool enabled) {
+    bus->setRenderingEnabled(enabled);
+  }
+
+  // How many frames differed between renderers in kDeferredChecked mode
+  uint64_t getMismatchedFrames() const { return bus->getMismatchedFrames(); }
+
+  // A 64-bit hash of the last frame drawn, computed as it completes. With a
+  // threaded render mode, call finishRendering first.
+  uint64_t getFrameHash() const { return bus->getFrameHash(); }
+
+  // Emulated time since power on, in dots (4194304 per second)
+  uint64_t getElapsedDots() const { return bus->getElapsedDots(); }
+
+  // Cartridge clocks run on emulated time by default, seeded so they read
+  // the host's time when the cartridge is loaded. The seed is the time at
+  // dot 0, in seconds since the Unix epoch, and is saved with the state.
+  void setRtcMode(RtcMode mode) { bus->setRtcMode(mode); }
+  uint64_t getRtcSeed() const { return bus->getRtcSeed(); }
+  void setRtcSeed(uint64_t seed) { bus->setRtcSeed(seed); }
+
+  // A hash of the cartridge's ROM, or 0 with none loaded
+  uint64_t getRomHash() const { return rom ? rom->getHash() : 0; }
+
+  // A hash of the cartridge: its ROM, and its RAM and clock as restored from
+  // the battery save
+  uint64_t getCartridgeHash() const;
+
+  // A hash of the whole machine state, for detecting when two runs diverge
+  uint64_t getStateHash();
+
+  // Saves the whole machine state into out, replacing its contents. The
+  // buffer's capacity is reused, so saving every frame doesn't allocate.
+  // States are tied to the cartridge they were saved with.
+  void saveState(std::vector<uint8_t> &out);
+
+  // Loads a state from saveState, returning an error string on failure.
+  // This is atomic: a state that's corrupt or for another cartridge is
+  // rejected before anything changes.
+  std::optional<std::string> loadState(const uint8_t *data, size_t size);
+
+  // The same, to and from files
+  std::optional<std::string> saveStateFile(const std::string &filename);
+  std::optional<std::string> loadStateFile(const std::string &filename);
+
+  // Creates a machine in the same state that then runs independently, e.g.
+  // on another thread. ROM is shared, and WRAM and cartridge RAM are shared
+  // copy-on-write, so only pages either side writes are ever copied. The
+  // fork never writes the battery save, and starts with default settings
+  // (immediate rendering, no audio) other than the RTC mode.
+  std::unique_ptr<Gameboy> fork();
+
+  // The same, into an existing machine, which saves constructing one. This
+  // is the cheap way to fork many times over: the cost is a few KB of
+  // copying plus the pages written since. Neither machine may be running.
+  void forkInto(Gameboy &child);
+
+  // Audio is off by default, which costs next to nothing. When on, samples
+  // are produced as emulation runs and should be read about once a frame;
+  // if they aren't, the oldest are dropped.
+  void setAudioEnabled(bool enabled) { bus->setAudioEnabled(enabled); }
+  void setAudioSampleRate(double sample_rate) {
+    bus->setAudioSampleRate(sample_rate);
+  }
+
+  // Reads up to max_frames interleaved stereo samples, returning how many
+  size_t readAudio(int16_t *out, size_t max_frames) {
+    return bus->readAudio(out, max_frames);
   }
 
  private:
   // cpu receives a copy of the bus handle, so initialization order matters here
   const std::shared_ptr<Bus> bus;
   Cpu cpu;
+
+  std::shared_ptr<const RomImage> rom;
+
+  // Every state for a cartridge is the same size, found on the first save
+  size_t state_size;
+  std::vector<uint8_t> scratch_state;
 };
 
 #endif  // DODO_GAMEBOY_H_
@@ -0,0 +1,41 @@
+#ifndef DODO_HASH_H_
+#define DODO_HASH_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// A streaming 64-bit non-cryptographic hash, producing the same output as
+// XXH64. Its four independent lanes keep the multipliers busy, so it runs at
+// several bytes per cycle. Multi-byte values are hashed in host byte order.
+class Hasher {
+ public:
+  explicit Hasher(uint64_t seed_ = 0);
+
+  void update(const void *data, size_t size);
+
+  // Hashes the bytes of a single scalar value
+  template <typename T>
+  void updateValue(const T &value) {
+    static_assert(std::is_scalar_v<T>, "Only hash values without padding");
+    update(&value, sizeof(value));
+  }
+
+  uint64_t digest() const;
+
+  static uint64_t hash(const void *data, size_t size, uint64_t seed = 0) {
+    Hasher hasher(seed);
+    hasher.update(data, size);
+    return hasher.digest();
+  }
+
+ private:
+  uint64_t seed;
+  std::array<uint64_t, 4> lanes;
+  std::array<uint8_t, 32> buffer;  // A partial stripe from the last update
+  size_t buffered;
+  uint64_t total_size;
+};
+
+#endif  // DODO_HASH_H_
@@ -0,0 +1,94 @@
+#ifndef DODO_LINE_RENDERER_H_
+#define DODO_LINE_RENDERER_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+const size_t kVramSize = 0x4000;
+const size_t kOamSize = 0xA0;
+
+const uint16_t dmg_colors[4] = {0x7FFF, 0x6318, 0x4210, 0x0000};
+
+using Line = std::array<uint16_t, 160>;
+using Frame = std::array<Line, 144>;
+
+// Everything besides VRAM and OAM that determines how a line is drawn,
+// captured by the PPU when the line enters mode 3
+struct LineState {
+  uint8_t lcd_y;
+  uint8_t control;
+  uint8_t scroll_x, scroll_y;
+  uint8_t window_x, window_y;
+
+  // Whether the window is drawn on this line, and which of its lines
+  bool window_visible;
+  uint16_t window_line;
+
+  bool cgb_mode;
+
+  uint8_t dmg_bg_palette;
+  uint8_t dmg_obj_palette[2];
+  uint8_t cgb_bg_palette[64];
+  uint8_t cgb_obj_palette[64];
+};
+
+// Draws lines from a LineState and a view of VRAM and OAM.
+// This holds no PPU timing state, so it can run on any thread as long as
+// the memory it references isn't written concurrently.
+//
+// The objects on each line are cached, so whoever owns the OAM must call
+// invalidateSprites when it changes, and updateSprites before drawing.
+// drawLine only reads the cache, so it may run on several threads at once.
+class LineRenderer {
+ public:
+  LineRenderer(const std::array<uint8_t, kVramSize> &vram_,
+               const std::array<uint8_t, kOamSize> &oam_)
+      : vram(vram_), oam(oam_), sprite_lists(), sprites_dirty(true) {}
+
+  void drawLine(const LineState &state, Line &line) const;
+
+  void invalidateSprites() { sprites_dirty = true; }
+  void updateSprites();
+
+ private:
+  const std::array<uint8_t, kVramSize> &vram;
+  const std::array<uint8_t, kOamSize> &oam;
+
+  // The (up to 10) objects selected for a line, as OAM indices
+  struct LineSprites {
+    uint8_t count;
+    std::array<uint8_t, 10> oam_order;  // CGB priority order
+    std::array<uint8_t, 10> x_order;    // DMG priority order
+  };
+
+  // Lists for 8x8 and 8x16 objects are both kept, so toggling the object
+  // size in LCDC doesn't require a rebuild
+  std::array<std::array<LineSprites, 144>, 2> sprite_lists;
+  bool sprites_dirty;
+
+  uint8_t readVramBank0(const uint16_t addr) const {
+    return vram[addr - 0x8000];
+  }
+
+  uint8_t readVramBank1(const uint16_t addr) const {
+    return vram[addr - 0x8000 + 0x2000];
+  }
+
+  // Per-pixel BG/window information that decides whether objects show
+  static constexpr uint8_t kBgOpaque = 0b01;    // Color index is non-zero
+  static constexpr uint8_t kBgPriority = 0b10;  // Opaque, with CGB attr bit 7
+  using LinePriority = std::array<uint8_t, 160>;
+
+  void drawBgLine(const LineState &state, Line &line,
+                  LinePriority &priority) const;
+  void drawWinLine(const LineState &state, Line &line,
+                   LinePriority &priority) const;
+  void drawTileRow(const LineState &state, uint16_t tile_map_addr,
+                   uint16_t line_index, size_t left_x, Line &line,
+                   LinePriority &priority) const;
+  void drawObjLine(const LineState &state, Line &line,
+                   const LinePriority &priority) const;
+};
+
+#endif  // DODO_LINE_RENDERER_H_
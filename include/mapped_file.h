@@ -0,0 +1,51 @@
+#ifndef DODO_MAPPED_FILE_H_
+#define DODO_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+
+// A read-only view of a whole file. Where possible the file is mapped into
+// memory, so nothing is copied, pages are read in when first touched, and
+// they're shared with anything else mapping the same file. Otherwise, e.g.
+// for pipes or on platforms without mmap, it's read into memory in one go.
+//
+// A mapping only stays fixed while the file does. If the file is rewritten
+// in place, pages not yet read may show the new contents, and reading past
+// a truncated end raises SIGBUS. Files replaced by renaming a new one over
+// them are safe.
+class MappedFile {
+ public:
+  // Either opens the file, or returns a string error
+  static std::variant<std::unique_ptr<MappedFile>, std::string> open(
+      const std::string &filename);
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *data() const { return bytes; }
+  size_t size() const { return length; }
+
+  // Whether the file is mapped, as opposed to having been read
+  bool isMapped() const { return mapped; }
+
+ private:
+  MappedFile() : bytes(nullptr), length(0), mapped(false) {}
+
+  const uint8_t *bytes;
+  size_t length;
+  bool mapped;
+
+  // Holds the contents when the file couldn't be mapped
+  std::vector<uint8_t> buffer;
+
+  bool map(const std::string &filename);
+  bool read(const std::string &filename);
+};
+
+#endif  // DODO_MAPPED_FILE_H_
@@ -2,9 +2,18 @@
 #define DODO_MBC_H_
 
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <string_view>
 
+#include "hash.h"
+#include "paged_memory.h"
+#include "rtc_clock.h"
+#include "save_state.h"
+
+// Cartridge RAM, in pages of one 8 KB bank
+using CartRam = PagedMemory<0x2000>;
+
 // An abstract "Memory Bus Controller" - dispatches accesses to cartridge memory
 class Mbc {
  public:
@@ -31,6 +40,33 @@ class Mbc {
     }
   }
 
+  // Hands any battery-backed RAM written since the last call to its save
+  // file. This is called every frame, and is cheap, as saves are written at
+  // most once a second and in the background.
+  virtual void flushSave() {}
+
+  // Writes anything still pending, then stops using the battery save, so
+  // nothing run from here on reaches the disk
+  virtual void detachSave() {}
+
+  // Cartridges with a real-time clock read the time from clock, which the
+  // bus owns
+  virtual void setRtcClock(const RtcClock * /*clock*/) {}
+
+  // Feeds RAM and banking state into hasher. ROM is left out, as it never
+  // changes.
+  virtual void hashState(Hasher &hasher) const = 0;
+
+  // Saves and loads the same state as is hashed. Loading leaves the save
+  // file alone, so an old state can't replace a newer save, until the game
+  // next writes battery-backed RAM; then all of it is saved.
+  virtual void saveState(StateWriter &writer) const = 0;
+  virtual void loadState(StateReader &reader) = 0;
+
+  // Creates a copy that shares the ROM, and shares RAM copy-on-write. The
+  // copy has no save file, so nothing it does reaches the disk.
+  virtual std::unique_ptr<Mbc> fork() = 0;
+
  protected:
   static std::string saveFileName(std::string_view filename) {
     return std::string(filename.substr(0, filename.find_last_of('.'))) + ".sav";
@@ -2,25 +2,40 @@
 #define DODO_MBC0_H_
 
 #include <cstdint>
-#include <vector>
+#include <memory>
 
 #include "mbc.h"
+#include "rom_image.h"
 
 class Mbc0 : public Mbc {
  public:
-  Mbc0(const std::vector<uint8_t> data, const size_t ram_size)
-      : rom(data), ram(ram_size) {}
+  Mbc0(std::shared_ptr<const RomImage> rom_, const size_t ram_size)
+      : rom(std::move(rom_)), ram(ram_size) {}
+
+  virtual void hashState(Hasher &hasher) const {
+    ram.hashState(hasher);
+  }
+
+  virtual void saveState(StateWriter &writer) const { ram.saveState(writer); }
+  virtual void loadState(StateReader &reader) { ram.loadState(reader); }
+
+  virtual std::unique_ptr<Mbc> fork() {
+    auto child = std::make_unique<Mbc0>(rom, ram.size());
+    child->ram.shareFrom(ram);
+    return child;
+  }
 
  private:
-  std::vector<uint8_t> rom, ram;
+  std::shared_ptr<const RomImage> rom;
+  CartRam ram;
 
-  virtual uint8_t readRomLo(uint16_t addr) { return rom[addr]; };
-  virtual uint8_t readRomHi(uint16_t addr) { return rom[addr + 0x4000]; };
+  virtual uint8_t readRomLo(uint16_t addr) { return (*rom)[addr]; };
+  virtual uint8_t readRomHi(uint16_t addr) { return (*rom)[addr + 0x4000]; };
   virtual uint8_t readRam(uint16_t addr) { return ram[addr]; };
 
   virtual void writeRomLo(uint16_t, uint8_t){};
   virtual void writeRomHi(uint16_t, uint8_t){};
-  virtual void writeRam(uint16_t addr, uint8_t data) { ram[addr] = data; };
+  virtual void writeRam(uint16_t addr, uint8_t data) { ram.write(addr, data); };
 };
 
 #endif  // DODO_MBC0_H_
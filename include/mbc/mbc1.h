@@ -2,43 +2,51 @@
 #define DODO_MBC1_H_
 
 #include <cstdint>
-#include <fstream>
-#include <optional>
-#include <string>
+#include <memory>
 #include <string_view>
-#include <vector>
 
 #include "mbc.h"
+#include "rom_image.h"
+#include "save_file.h"
 
 class Mbc1 : public Mbc {
  public:
   Mbc1(const std::string_view filename, const uint8_t type,
-       const std::vector<uint8_t> data, const size_t ram_size)
-      : rom(data),
+       std::shared_ptr<const RomImage> rom_, const size_t ram_size)
+      : rom(std::move(rom_)),
+        ram(ram_size),
         ram_enabled(),
         rom_bank_lo(1),
         ram_bank_or_rom_bank_hi(0),
         bank_mode() {
     if (type == 0x03) {
-      ram.reserve(ram_size);
-      savefile_opt = this->saveFileName(filename);
+      save = std::make_unique<SaveFile>(saveFileName(filename), ram_size);
       restoreSaveFile();
-    } else {
-      savefile_opt = std::nullopt;
-      ram.resize(ram_size, 0);
     }
   }
 
-  ~Mbc1() { writeSaveFile(); }
+  ~Mbc1() { writeSaveFile(true); }
+
+  virtual void flushSave() { writeSaveFile(false); }
+  virtual void detachSave() {
+    writeSaveFile(true);
+    save.reset();
+  }
+
+  virtual void hashState(Hasher &hasher) const;
+  virtual void saveState(StateWriter &writer) const;
+  virtual void loadState(StateReader &reader);
+  virtual std::unique_ptr<Mbc> fork();
 
  private:
-  std::vector<uint8_t> rom, ram;
+  std::shared_ptr<const RomImage> rom;
+  CartRam ram;
 
   bool ram_enabled;
   uint8_t rom_bank_lo, ram_bank_or_rom_bank_hi;
   bool bank_mode;
 
-  std::optional<std::string> savefile_opt;
+  std::unique_ptr<SaveFile> save;
 
   virtual uint8_t readRomLo(uint16_t addr);
   virtual uint8_t readRomHi(uint16_t addr);
@@ -49,7 +57,7 @@ class Mbc1 : public Mbc {
   virtual void writeRam(uint16_t addr, uint8_t data);
 
   void restoreSaveFile();
-  void writeSaveFile();
+  void writeSaveFile(bool force);
 };
 
 #endif  // DODO_MBC1_H_
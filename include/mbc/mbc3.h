@@ -2,47 +2,64 @@
 #define DODO_MBC3_H_
 
 #include <cstdint>
-#include <optional>
-#include <vector>
+#include <memory>
 
 #include "mbc.h"
+#include "rom_image.h"
+#include "save_file.h"
 
 class Mbc3 : public Mbc {
  public:
   Mbc3(const std::string_view filename, const uint8_t type,
-       const std::vector<uint8_t> data, const size_t ram_size)
-      : rom(data),
+       std::shared_ptr<const RomImage> rom_, const size_t ram_size)
+      : rom(std::move(rom_)),
+        ram(ram_size),
         ram_rtc_enabled(),
         rtc_latch(),
         rom_hi_bank(1),
         ram_bank_or_rtc_reg(0),
         rtc{},
-        rtc_base(0) {
+        rtc_base(0),
+        clock(nullptr) {
     if (type == 0x0F || type == 0x10 || type == 0x13) {
-      ram.reserve(ram_size);
-      savefile_opt = this->saveFileName(filename);
+      save = std::make_unique<SaveFile>(saveFileName(filename), ram_size);
       const bool restore_ram = (type == 0x10 || type == 0x13);
       const bool try_restore_rtc = (type == 0x0F || type == 0x10);
       restoreSaveFile(restore_ram, try_restore_rtc);
-    } else {
-      savefile_opt = std::nullopt;
-      ram.resize(ram_size, 0);
     }
   }
 
-  ~Mbc3() { writeSaveFile(); }
+  ~Mbc3() { writeSaveFile(true); }
+
+  virtual void flushSave() { writeSaveFile(false); }
+  virtual void detachSave() {
+    writeSaveFile(true);
+    save.reset();
+  }
+  virtual void setRtcClock(const RtcClock *clock_) { clock = clock_; }
+
+  virtual void hashState(Hasher &hasher) const;
+  virtual void saveState(StateWriter &writer) const;
+  virtual void loadState(StateReader &reader);
+  virtual std::unique_ptr<Mbc> fork();
 
  private:
-  std::vector<uint8_t> rom, ram;
+  std::shared_ptr<const RomImage> rom;
+  CartRam ram;
 
   bool ram_rtc_enabled, rtc_latch;
   uint8_t rom_hi_bank;
   uint8_t ram_bank_or_rtc_reg;
 
   uint8_t rtc[5];
-  uint64_t rtc_base;
+  uint64_t rtc_base;  // When the RTC would have read zero
+
+  const RtcClock *clock;
+  uint64_t now() const {
+    return clock ? clock->now() : RtcClock::wallClockSeconds();
+  }
 
-  std::optional<std::string> savefile_opt;
+  std::unique_ptr<SaveFile> save;
 
   virtual uint8_t readRomLo(uint16_t addr);
   virtual uint8_t readRomHi(uint16_t addr);
@@ -55,7 +72,7 @@ class Mbc3 : public Mbc {
   void computeRtcBase();
 
   void restoreSaveFile(const bool restore_ram, const bool try_restore_rtc);
-  void writeSaveFile();
+  void writeSaveFile(bool force);
 };
 
 #endif  // DODO_MBC3_H_
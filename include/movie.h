@@ -0,0 +1,145 @@
+#ifndef DODO_MOVIE_H_
+#define DODO_MOVIE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "gameboy.h"
+#include "mapped_file.h"
+
+// An input movie records a session so it can be replayed exactly: the state
+// it started from, then every change of buttons at the emulated dot it was
+// applied. Emulation is deterministic, so that's all a replay needs.
+//
+// About once a second of emulated time, a hash of the whole state is stored
+// too. Replaying checks each one, so a replay that goes out of step (e.g.
+// after a change to the emulator) is caught near where it happened.
+//
+// Replays are only exact with the emulated RTC, which playing always uses.
+// The RTC seed is part of the starting state, and is copied into the header
+// for reference.
+//
+// After a header of "DODOMOVI", the version (u32), the RTC seed (u64) and
+// the starting state's size (u64) and bytes, the file is a series of
+// records. Each is a type byte and the dots since the last record (varint),
+// then:
+//   kInput: the buttons, (action << 4) | dir
+//   kHash:  the state hash (u64)
+//   kLoad:  a state that was loaded there, e.g. by rewinding, as a delta
+//           (see state_delta.h) from the last state in the movie, i.e. the
+//           starting state or the last one loaded: its size (varint) and
+//           bytes. Time is counted from the loaded state's on.
+// Values are in host byte order, like save states.
+class MovieWriter {
+ public:
+  // Starts a movie from gameboy's current state
+  static std::variant<std::unique_ptr<MovieWriter>, std::string> create(
+      const std::string &filename, Gameboy &gameboy);
+
+  // Writes a last hash, so a replay runs to here, and closes the file,
+  // returning an error string if anything failed to be written
+  std::optional<std::string> finish(Gameboy &gameboy);
+
+  // Records buttons just applied with setButtonsPressed, if they've changed.
+  // Call this every frame: it's also where hashes are taken.
+  void recordInput(Gameboy &gameboy, uint8_t buttons);
+
+  // Records that a state was just loaded, at the time given from before the
+  // load
+  void recordLoad(Gameboy &gameboy, uint64_t dots_before);
+
+ private:
+  // How often hashes are stored, in dots
+  static constexpr uint64_t kHashInterval = 4194304;
+
+  std::ofstream file;
+  uint64_t last_dots;       // When the last record was
+  uint64_t next_hash_dots;  // When the next hash is due
+  int last_buttons;         // Or -1 if the next input must be recorded
+
+  std::vector<uint8_t> record;  // The record being written
+  std::vector<uint8_t> state, delta;
+  std::vector<uint8_t> base;  // The last state in the movie
+
+  MovieWriter() : last_dots(0), next_hash_dots(0), last_buttons(-1) {}
+
+  // Starts a record of the given type at the given time
+  void beginRecord(StateWriter &writer, uint8_t type, uint64_t dots);
+  void writeRecord();
+  void recordHash(Gameboy &gameboy);
+};
+
+// Replays a movie, as fast as possible
+class MoviePlayer {
+ public:
+  // Either opens the movie and checks its header, or returns a string error
+  static std::variant<std::unique_ptr<MoviePlayer>, std::string> open(
+      const std::string &filename);
+
+  uint64_t getRtcSeed() const { return rtc_seed; }
+
+  // A hash of the whole movie, for keying snapshots of its replay
+  uint64_t getHash() const { return hash; }
+
+  // Loads the starting state into gameboy, returning an error string if
+  // it's for another cartridge. gameboy stops writing its battery save, as
+  // nothing in a replay should change it.
+  std::optional<std::string> start(Gameboy &gameboy);
+
+  // Runs the movie until its end, or until max_frames more frames have
+  // run. Returns an error string if it's corrupt or the replay went out of
+  // step.
+  std::optional<std::string> play(Gameboy &gameboy,
+                                  uint64_t max_frames = UINT64_MAX);
+
+  bool isFinished() const { return offset == records_size; }
+
+  // How far play has got, which is kept with a snapshot of the machine to
+  // carry on playing from it. Call start before loading a position.
+  void savePosition(StateWriter &writer) const;
+  bool loadPosition(StateReader &reader);
+
+  // Totals over every call to play
+  uint64_t getFrames() const { return frames; }
+  uint64_t getHashesChecked() const { return hashes_checked; }
+
+ private:
+  std::unique_ptr<MappedFile> file;
+  size_t state_offset, state_size;  // The starting state
+  const uint8_t *records;
+  size_t records_size;
+  uint64_t rtc_seed;
+  uint64_t hash;
+
+  size_t offset;  // Of the next record
+  uint64_t dots;  // When the last record was
+
+  // The last state played, which the next load's delta is from
+  std::vector<uint8_t> base;
+
+  uint64_t frames, hashes_checked;
+
+  MoviePlayer()
+      : state_offset(0),
+        state_size(0),
+        records(nullptr),
+        records_size(0),
+        rtc_seed(0),
+        hash(0),
+        offset(0),
+        dots(0),
+        frames(0),
+        hashes_checked(0) {}
+
+  // Runs until the given time or frame, returning false if the time falls
+  // inside an instruction
+  bool runUntil(Gameboy &gameboy, uint64_t until_dots, uint64_t until_frame);
+};
+
+#endif  // DODO_MOVIE_H_
@@ -0,0 +1,116 @@
+#ifndef DODO_PAGED_MEMORY_H_
+#define DODO_PAGED_MEMORY_H_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "hash.h"
+#include "save_state.h"
+
+// RAM stored as fixed-size pages that can be shared copy-on-write, so a
+// forked machine starts out with the same memory for only the cost of
+// copying page pointers.
+//
+// Shared pages are never written: the first write to one copies it, so
+// machines sharing pages may run on different threads. Sharing itself
+// (shareFrom) must happen while neither side is running.
+template <size_t PageSize>
+class PagedMemory {
+ public:
+  static constexpr size_t kPageSize = PageSize;
+
+  // size is rounded up to a whole number of pages
+  explicit PagedMemory(size_t size = 0)
+      : pages((size + PageSize - 1) / PageSize),
+        bytes(pages.size()),
+        owned(pages.size(), true) {
+    for (size_t i = 0; i < pages.size(); i++) {
+      pages[i] = std::make_shared<Page>();
+      bytes[i] = pages[i]->data();
+    }
+  }
+
+  size_t size() const { return pages.size() * PageSize; }
+  size_t pageCount() const { return pages.size(); }
+
+  uint8_t operator[](size_t index) const {
+    return bytes[index / PageSize][index % PageSize];
+  }
+
+  void write(size_t index, uint8_t data) {
+    const size_t page = index / PageSize;
+    if (!owned[page]) detach(page, true);
+    bytes[page][index % PageSize] = data;
+  }
+
+  // The bytes of a page, which mustn't be kept past the next write
+  const uint8_t *page(size_t n) const { return bytes[n]; }
+
+  // Copies from data into the start of memory, up to its size
+  void copyIn(const uint8_t *data, size_t size_) {
+    size_ = std::min(size_, size());
+    for (size_t page_n = 0; page_n * PageSize < size_; page_n++) {
+      const size_t n = std::min(PageSize, size_ - page_n * PageSize);
+      if (!owned[page_n]) detach(page_n, n < PageSize);
+      std::copy_n(data + page_n * PageSize, n, bytes[page_n]);
+    }
+  }
+
+  // Makes this memory share other's pages, which from then on are copied by
+  // whichever side writes to them first. Both must be the same size.
+  void shareFrom(PagedMemory &other) {
+    pages = other.pages;
+    bytes = other.bytes;
+    std::fill(owned.begin(), owned.end(), false);
+    std::fill(other.owned.begin(), other.owned.end(), false);
+  }
+
+  // How many pages have been copied or written since they were last shared
+  size_t ownedPages() const {
+    return static_cast<size_t>(std::count(owned.begin(), owned.end(), true));
+  }
+
+  void hashState(Hasher &hasher) const {
+    for (const uint8_t *page_bytes : bytes) hasher.update(page_bytes, PageSize);
+  }
+
+  void saveState(StateWriter &writer) const {
+    for (const uint8_t *page_bytes : bytes) writer.write(page_bytes, PageSize);
+  }
+
+  void loadState(StateReader &reader) {
+    for (size_t i = 0; i < pages.size(); i++) loadPage(reader, i);
+  }
+
+  // Loads a single page, returning whether its contents changed. Pages that
+  // haven't changed are left alone, so they stay shared.
+  bool loadPage(StateReader &reader, size_t n) {
+    const uint8_t *data = reader.take(PageSize);
+    if (!data || std::equal(data, data + PageSize, bytes[n])) return false;
+    if (!owned[n]) detach(n, false);
+    std::copy_n(data, PageSize, bytes[n]);
+    return true;
+  }
+
+ private:
+  using Page = std::array<uint8_t, PageSize>;
+
+  std::vector<std::shared_ptr<Page>> pages;
+  std::vector<uint8_t *> bytes;  // Each page's data, to save a dereference
+  std::vector<bool> owned;       // Pages no other memory shares
+
+  // Gives this memory its own copy of a page, keeping the contents or not
+  void detach(size_t page, bool keep) {
+    auto copy = keep ? std::make_shared<Page>(*pages[page])
+                     : std::make_shared<Page>();
+    pages[page] = std::move(copy);
+    bytes[page] = pages[page]->data();
+    owned[page] = true;
+  }
+};
+
+#endif  // DODO_PAGED_MEMORY_H_
@@ -0,0 +1,101 @@
+#ifndef DODO_POST_PROCESSOR_H_
+#define DODO_POST_PROCESSOR_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "line_renderer.h"
+#include "thread_pool.h"
+
+enum class ScaleFilter {
+  kNearest,
+  kScale2x,
+  kScale3x,
+  kScale4x,
+  kXbr2x,
+  kXbr4x
+};
+
+// Turns completed frames into display pixels: converts BGR555 to XRGB8888,
+// optionally correcting colors and blending with the previous frame, then
+// upscales with the chosen filter. Each pass is split into bands of rows that
+// run on the shared thread pool.
+class PostProcessor {
+ public:
+  // scale is only used by kNearest; the other filters have a fixed factor
+  PostProcessor(ScaleFilter filter_, int scale_);
+
+  int getScale() const { return scale; }
+  size_t getWidth() const { return 160 * static_cast<size_t>(scale); }
+  size_t getHeight() const { return 144 * static_cast<size_t>(scale); }
+
+  // Maps colors the way the CGB LCD shows them, rather than at full saturation
+  void setColorCorrection(bool enabled);
+  // Averages each frame with the previous one, like the LCD's slow response
+  void setFrameBlending(bool enabled);
+
+  // Writes the processed frame to out, whose rows are pitch pixels apart
+  void process(const Frame &frame, uint32_t *out, size_t pitch);
+
+ private:
+  // XRGB8888 pixels with a border of repeated edge pixels, so filters can
+  // read neighbours without bounds checks
+  struct Image {
+    static constexpr size_t kBorder = 2;
+
+    Image(size_t width_, size_t height_)
+        : width(width_),
+          height(height_),
+          pixels((width_ + 2 * kBorder) * (height_ + 2 * kBorder)) {}
+
+    size_t width, height;
+    std::vector<uint32_t> pixels;
+
+    size_t pitch() const { return width + 2 * kBorder; }
+    uint32_t *row(size_t y) {
+      return &pixels[(y + kBorder) * pitch() + kBorder];
+    }
+    const uint32_t *row(size_t y) const {
+      return &pixels[(y + kBorder) * pitch() + kBorder];
+    }
+
+    void fillBorder();
+  };
+
+  ScaleFilter filter;
+  int scale;
+  ThreadPool &pool;
+
+  // BGR555 to XRGB8888, with or without color correction
+  std::unique_ptr<std::array<uint32_t, 0x8000>> color_lut;
+
+  // The last converted frame, before blending
+  bool frame_blending;
+  bool have_previous;
+  std::vector<uint32_t> previous;
+
+  Image input;         // The converted frame
+  Image intermediate;  // The result of the first 2x pass of a 4x filter
+
+  // Runs func(begin, end) over bands of [0, rows)
+  template <typename Func>
+  void forBands(size_t rows, const Func &func);
+
+  void convert(const Frame &frame, size_t begin, size_t end);
+  void blendPrevious(size_t begin, size_t end);
+
+  // Each filter scales rows [begin, end) of src into dst
+  static void nearest(const Image &src, uint32_t *dst, size_t pitch, int n,
+                      size_t begin, size_t end);
+  static void scale2x(const Image &src, uint32_t *dst, size_t pitch,
+                      size_t begin, size_t end);
+  static void scale3x(const Image &src, uint32_t *dst, size_t pitch,
+                      size_t begin, size_t end);
+  static void xbr2x(const Image &src, uint32_t *dst, size_t pitch,
+                    size_t begin, size_t end);
+};
+
+#endif  // DODO_POST_PROCESSOR_H_
@@ -2,24 +2,77 @@
 #define DODO_PPU_H_
 
 #include <array>
+#include <bitset>
 #include <cstdint>
 #include <memory>
 
-const size_t kVramSize = 0x4000;
-const size_t kOamSize = 0xA0;
+#include "deferred_renderer.h"
+#include "frame_publisher.h"
+#include "hash.h"
+#include "line_renderer.h"
+#include "render_worker.h"
+#include "save_state.h"
 
 const int kIntMaskVblank = 0b1;
 const int kIntMaskStat = 0b10;
 
-const uint16_t dmg_colors[4] = {0x7FFF, 0x6318, 0x4210, 0x0000};
+const int kDotsPerLine = 456;
+const int kDotsPerFrame = kDotsPerLine * 154;
+
+// kImmediate draws each line on the emulation thread as it enters mode 3.
+// kWorker captures the line's state instead, and a RenderWorker draws it in
+// parallel with emulation.
+// kDeferred captures every line's state and draws the whole frame at VBlank.
+// kDeferredChecked does the same, but also draws immediately and reports any
+// frames where the two differ.
+enum class RenderMode { kImmediate, kWorker, kDeferred, kDeferredChecked };
 
 class Ppu {
  public:
-  Ppu() : vram(), oam() {}
+  Ppu()
+      : vram(),
+        oam(),
+        ppu_tick_divider(0),
+        vram_bank(false),
+        cgb_mode(false),
+        control(0),
+        compare_interrupt(false),
+        mode_0_interrupt(false),
+        mode_1_interrupt(false),
+        mode_2_interrupt(false),
+        mode_3_interrupt(false),
+        stat_mode(kModeOamSearch),
+        scroll_x(0),
+        scroll_y(0),
+        lcd_y(0),
+        lcd_y_compare(0),
+        window_x(0),
+        window_y(0),
+        dmg_bg_palette(0),
+        dmg_obj_palette(),
+        cgb_bg_palette_index(0),
+        cgb_obj_palette_index(0),
+        cgb_bg_palette_auto_incr(false),
+        cgb_obj_palette_auto_incr(false),
+        cgb_bg_palette(),
+        cgb_obj_palette(),
+        window_start_line(-1),
+        window_internal_line(0),
+        renderer(vram, oam),
+        render_mode(RenderMode::kImmediate),
+        rendering(true),
+        frame_skip(0),
+        frames_until_render(0),
+        mismatched_frames(0) {}
 
   // Returns (interrupt triggered mask, new frame ready)
   uint8_t tick(int ppu_ticks);
 
+  // How many ticks can pass before the PPU might raise an interrupt.
+  // Until then, ticks can be batched up as long as nothing reads or writes
+  // PPU state in the meantime.
+  int ticksUntilNextEvent() const;
+
   uint8_t read(uint16_t addr);
   void write(uint16_t addr, uint8_t data);
 
@@ -27,11 +80,20 @@ class Ppu {
     return vram[translateVramAddr(addr)];
   }
   void writeVram(uint16_t addr, uint8_t data) {
-    vram[translateVramAddr(addr)] = data;
+    uint16_t index = translateVramAddr(addr);
+    vram[index] = data;
+    if (worker) worker->writeVram(index, data);
+    if (deferred) deferred->writeVram(index, data);
   }
 
   uint8_t readOam(uint16_t addr) const { return oam[addr - 0xFE00]; }
-  void writeOam(uint16_t addr, uint8_t data) { oam[addr - 0xFE00] = data; }
+  void writeOam(uint16_t addr, uint8_t data) {
+    uint16_t index = addr - 0xFE00;
+    oam[index] = data;
+    renderer.invalidateSprites();
+    if (worker) worker->writeOam(index, data);
+    if (deferred) deferred->writeOam(index, data);
+  }
 
   bool getVramBank() const { return vram_bank; }
   void setVramBank(bool vram_bank_) { this->vram_bank = vram_bank_; }
@@ -40,10 +102,43 @@ class Ppu {
 
   bool inHblank() { return stat_mode == kModeHblank; }
 
-  const std::array<std::array<uint16_t, 160>, 144> &getFrame() const {
-    return framebuffer;
+  RenderMode getRenderMode() const { return render_mode; }
+  void setRenderMode(RenderMode mode);
+
+  // Blocks until every line captured so far has been drawn
+  void finishRendering() {
+    if (worker) worker->finish();
   }
 
+  // Only draw one out of every (frame_skip + 1) frames. Skipped frames still
+  // run, but aren't drawn or published.
+  void setFrameSkip(int frame_skip_) { this->frame_skip = frame_skip_; }
+
+  // With rendering off, frames run but aren't drawn or published, and don't
+  // count towards frame skip. Only change this between frames.
+  void setRenderingEnabled(bool enabled) { rendering = enabled; }
+
+  // How many frames differed between renderers in kDeferredChecked mode
+  uint64_t getMismatchedFrames() const { return mismatched_frames; }
+
+  // Returns the most recently completed frame. This is the consumer side of
+  // the frame buffers, so it may be called from a different thread than tick,
+  // but only ever from one thread at a time.
+  const PublishedFrame &getFrame() { return frames.acquire(); }
+
+  // The hash of the last frame drawn. With a threaded render mode, call
+  // finishRendering first.
+  uint64_t getFrameHash() const { return frames.getLastHash(); }
+
+  // Feeds everything that affects emulation into hasher, leaving out how
+  // frames are rendered
+  void hashState(Hasher &hasher) const;
+
+  // The same state as is hashed. Loading restarts any threaded renderer
+  // from the loaded memory.
+  void saveState(StateWriter &writer) const;
+  void loadState(StateReader &reader);
+
  private:
   std::array<uint8_t, kVramSize> vram;
   std::array<uint8_t, kOamSize> oam;
@@ -78,31 +173,40 @@ class Ppu {
   int16_t window_start_line;
   uint8_t window_internal_line;
 
-  std::array<std::array<uint16_t, 160>, 144> framebuffer;
+  // Lines are drawn into the back buffer, which is published at VBlank
+  FramePublisher frames;
+
+  LineRenderer renderer;
+  RenderMode render_mode;
+  // Only exists in kWorker mode. Declared after everything it references so
+  // it is joined before they are destroyed.
+  std::unique_ptr<RenderWorker> worker;
+  // Only exist in the kDeferred modes; check_frame is the immediate output
+  // that kDeferredChecked compares against
+  std::unique_ptr<DeferredRenderer> deferred;
+  std::unique_ptr<Frame> check_frame;
+  // Lines drawn into check_frame this frame. Only these are compared, as
+  // the rest hold whatever either buffer had from an earlier frame.
+  std::bitset<144> checked_lines;
+
+  bool rendering;
+  int frame_skip, frames_until_render;
+  uint64_t mismatched_frames;
 
   uint16_t translateVramAddr(const uint16_t addr) const {
     uint16_t bank = 0x2000 * (cgb_mode ? vram_bank : 0);
     return bank + (addr - 0x8000);
   }
 
-  uint8_t readVramBank0(const uint16_t addr) const {
-    return vram[addr - 0x8000];
-  }
-
-  uint8_t readVramBank1(const uint16_t addr) const {
-    return vram[addr - 0x8000 + 0x2000];
-  }
+  // Captures everything needed to draw the current line, and advances the
+  // window's internal line counter
+  LineState captureLineState();
 
   void drawLine();
-  void drawBgLine();
-  void drawWinLine();
-  void drawObjLine();
-
-  void drawObj(std::array<std::array<uint16_t, 160>, 144> &frame);
+  void endFrame();
 
-  struct OamEntry {
-    uint8_t y, x, tile_index, attrs;
-  };
+  // Recreates the renderers render_mode needs, from the current memory
+  void resetRenderers();
 };
 
 #endif  // DODO_PPU_H_
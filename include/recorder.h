@@ -0,0 +1,111 @@
+#ifndef DODO_RECORDER_H_
+#define DODO_RECORDER_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_delta.h"
+#include "frame_publisher.h"
+#include "spsc_queue.h"
+
+// Writes video and audio to files on a background thread, so emulation can
+// run as fast as it likes while the writer keeps up.
+//
+// Video is written as YUV4MPEG2 (4:4:4) if the file name ends in ".y4m", and
+// otherwise as raw 24-bit RGB frames. Audio is written as 16-bit stereo WAV.
+// The emulator's own frames can also be written, before post-processing, as
+// a stream of frame deltas (see frame_delta.h), each preceded by its size as
+// a little-endian u32. Every delta is decoded again as it's written and
+// checked against its frame, so a stream that wouldn't play back is caught.
+// Work is handed over in a fixed number of buffers, so if the writer falls
+// behind, the producer waits for it rather than queueing without bound.
+class Recorder {
+ public:
+  Recorder();
+
+  // Finishes writing everything submitted so far
+  ~Recorder();
+
+  Recorder(const Recorder &) = delete;
+  Recorder &operator=(const Recorder &) = delete;
+
+  // Both return an error string on failure, and must be called before the
+  // first frame or samples are submitted. The frame rate is given as a
+  // fraction, e.g. 4194304/70224 for the Game Boy's.
+  std::optional<std::string> openVideo(const std::string &filename,
+                                       size_t width_, size_t height_,
+                                       uint64_t rate_num, uint64_t rate_den);
+  std::optional<std::string> openAudio(const std::string &filename,
+                                       int sample_rate);
+  std::optional<std::string> openFrameDeltas(const std::string &filename);
+
+  bool hasVideo() const { return video.is_open(); }
+  bool hasAudio() const { return audio.is_open(); }
+  bool hasFrameDeltas() const { return deltas.is_open(); }
+
+  // Returns a width * height XRGB8888 buffer to draw the next frame into,
+  // waiting for one to be free if the writer is behind. Pass it to
+  // submitFrame once drawn.
+  uint32_t *beginFrame();
+  void submitFrame();
+
+  // Writes the last submitted frame again, e.g. while the LCD is off
+  void repeatFrame();
+
+  void writeAudio(const int16_t *samples, size_t n_frames);
+
+  // Copies the frame, which is encoded on the writer thread
+  void writeFrameDelta(const PublishedFrame &frame);
+
+  // Waits for the writer to finish and closes the files, returning an error
+  // string if anything failed to be written
+  std::optional<std::string> close();
+
+ private:
+  static constexpr size_t kBuffers = 8;
+
+  struct Job {
+    enum class Type { kFrame, kRepeat, kAudio, kFrameDelta, kStop } type;
+    std::vector<uint32_t> pixels;
+    std::vector<int16_t> samples;
+    std::unique_ptr<PublishedFrame> frame;  // Allocated on first use
+  };
+
+  std::array<Job, kBuffers> jobs;
+  SpscQueue<uint32_t, kBuffers> free_jobs;   // Returned by the writer
+  SpscQueue<uint32_t, kBuffers> ready_jobs;  // Filled by the producer
+  uint32_t current;  // The job being filled, or kBuffers if none
+
+  std::ofstream video, audio, deltas;
+  bool y4m;
+  size_t width, height;
+
+  // Only touched by the writer thread
+  uint64_t audio_bytes;
+  std::vector<uint8_t> frame_bytes;  // The last frame as written
+  std::vector<uint8_t> sample_bytes;
+  FrameDeltaEncoder encoder;
+  FrameDeltaDecoder decoder;
+  std::vector<uint8_t> delta_bytes;
+  uint64_t bad_deltas;  // That didn't decode to their frames
+
+  std::thread thread;
+
+  uint32_t acquireJob();
+  void submitJob(Job::Type type);
+
+  void run();
+  void writeFrame(const std::vector<uint32_t> &pixels);
+  void writeSamples(const std::vector<int16_t> &samples);
+  void encodeFrameDelta(const PublishedFrame &frame);
+  void finishWav();
+};
+
+#endif  // DODO_RECORDER_H_
@@ -0,0 +1,79 @@
+#ifndef DODO_RENDER_WORKER_H_
+#define DODO_RENDER_WORKER_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#include "frame_publisher.h"
+#include "line_renderer.h"
+#include "spsc_queue.h"
+
+// Renders lines on a separate thread from LineStates captured by the PPU.
+// The worker keeps its own copy of VRAM and OAM, which it brings up to date
+// from a journal of writes before drawing each line, so it always sees memory
+// exactly as the PPU did when the line was captured.
+class RenderWorker {
+ public:
+  // Starts from a copy of the given memory, and becomes the producer of frames
+  RenderWorker(const std::array<uint8_t, kVramSize> &vram_,
+               const std::array<uint8_t, kOamSize> &oam_,
+               FramePublisher &frames_);
+
+  // Finishes all pending work before stopping the thread
+  ~RenderWorker();
+
+  RenderWorker(const RenderWorker &) = delete;
+  RenderWorker &operator=(const RenderWorker &) = delete;
+
+  // Indices are offsets into VRAM/OAM, as opposed to bus addresses
+  void writeVram(uint16_t index, uint8_t data) { journalWrite({index, data}); }
+  void writeOam(uint16_t index, uint8_t data) {
+    journalWrite({static_cast<uint16_t>(kOamFlag | index), data});
+  }
+
+  void drawLine(const LineState &state);
+  void endFrame();
+
+  // Blocks until every line submitted so far has been drawn
+  void finish();
+
+  // Finishes, then replaces the worker's copy of VRAM and OAM, e.g. after a
+  // state is loaded. Cheaper than starting a new worker.
+  void reload(const std::array<uint8_t, kVramSize> &vram_,
+              const std::array<uint8_t, kOamSize> &oam_);
+
+ private:
+  static constexpr uint16_t kOamFlag = 0x8000;
+
+  struct MemoryWrite {
+    uint16_t index;  // kOamFlag is set for OAM writes
+    uint8_t data;
+  };
+
+  struct Job {
+    enum class Type { kLine, kFrameEnd, kSync, kStop } type;
+    uint64_t journal_end;  // How many writes must be applied before this job
+    LineState state;
+  };
+
+  std::array<uint8_t, kVramSize> vram;
+  std::array<uint8_t, kOamSize> oam;
+  LineRenderer renderer;
+  FramePublisher &frames;
+
+  SpscQueue<MemoryWrite, 1 << 16> journal;
+  SpscQueue<Job, 256> jobs;
+  uint64_t journal_applied;  // Only touched by the worker thread
+  std::atomic<uint64_t> jobs_done;
+
+  std::thread thread;
+
+  void journalWrite(MemoryWrite write);
+  void pushJob(Job::Type type, const LineState &state = {});
+  void applyJournal(uint64_t journal_end);
+  void run();
+};
+
+#endif  // DODO_RENDER_WORKER_H_
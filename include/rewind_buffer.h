@@ -0,0 +1,55 @@
+#ifndef DODO_REWIND_BUFFER_H_
+#define DODO_REWIND_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// A history of save states in a fixed amount of memory, for rewinding.
+//
+// Only the newest state is kept whole. Each older one is stored as its
+// delta (see state_delta.h) from the state after it, which usually costs a
+// few KB.
+//
+// Deltas live in a ring of the budgeted size, allocated once. When it
+// fills, the oldest states are dropped to make room.
+class RewindBuffer {
+ public:
+  explicit RewindBuffer(size_t budget_bytes);
+
+  // Adds a state as the newest. A state of a different size from the last
+  // one (e.g. from another cartridge) starts the history again.
+  void push(const std::vector<uint8_t> &state);
+
+  // Moves the newest state into out and removes it from the history,
+  // returning false if there are none left
+  bool pop(std::vector<uint8_t> &out);
+
+  void clear();
+
+  // How many states can be popped
+  size_t size() const { return entries.size() + (has_newest ? 1 : 0); }
+
+  // Bytes of the ring in use by deltas, not counting the newest state
+  size_t bytesUsed() const;
+
+ private:
+  struct Entry {
+    size_t offset, size;
+  };
+
+  std::vector<uint8_t> ring;
+  std::deque<Entry> entries;  // Oldest first
+  size_t head;                // Where the next delta goes
+
+  std::vector<uint8_t> newest;
+  bool has_newest;
+
+  std::vector<uint8_t> scratch;  // The delta being encoded
+
+  // Finds space for a delta of the given size, dropping old ones as needed
+  size_t allocate(size_t size);
+};
+
+#endif  // DODO_REWIND_BUFFER_H_
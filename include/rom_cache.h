@@ -0,0 +1,55 @@
+#ifndef DODO_ROM_CACHE_H_
+#define DODO_ROM_CACHE_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <variant>
+
+#include "rom_image.h"
+
+// Hands out shared ROM images, so any number of emulators running the same
+// cartridge hold one copy of it between them.
+//
+// Images are looked up first by path, and then by content hash, so the same
+// ROM under two names is still only held once. The cache only keeps weak
+// references: an image is freed once nothing uses it, and a file that
+// changes on disk is loaded again, provided it was replaced rather than
+// rewritten in place (see RomImage). Safe to use from multiple threads.
+class RomCache {
+ public:
+  RomCache() = default;
+
+  RomCache(const RomCache &) = delete;
+  RomCache &operator=(const RomCache &) = delete;
+
+  // A process-wide cache
+  static RomCache &shared();
+
+  // Either returns the image for the file, loading it if needed, or returns
+  // a string error
+  std::variant<std::shared_ptr<const RomImage>, std::string> load(
+      const std::string &filename);
+
+  // How many distinct images are alive
+  size_t size();
+
+ private:
+  struct PathEntry {
+    uintmax_t file_size;
+    std::filesystem::file_time_type modified;
+    std::weak_ptr<const RomImage> image;
+  };
+
+  std::mutex mutex;
+  std::unordered_map<std::string, PathEntry> by_path;
+  std::unordered_map<uint64_t, std::weak_ptr<const RomImage>> by_hash;
+
+  // Drops entries whose images have been freed
+  void prune();
+};
+
+#endif  // DODO_ROM_CACHE_H_
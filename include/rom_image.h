@@ -0,0 +1,59 @@
+#ifndef DODO_ROM_IMAGE_H_
+#define DODO_ROM_IMAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <variant>
+
+#include "hash.h"
+#include "mapped_file.h"
+
+// The contents of a cartridge ROM, which MBCs share through a shared_ptr
+// rather than each holding a copy.
+//
+// The file is mapped rather than copied, but hashing it on load reads every
+// page, so loading still costs a full read; what's saved is the copy, and
+// the memory, which is shared with every other mapping of the file. The
+// contents and hash only stay fixed while the file does (see MappedFile):
+// replace a ROM by renaming a new file over it, never by rewriting it in
+// place while it's running.
+class RomImage {
+ public:
+  explicit RomImage(std::unique_ptr<MappedFile> file_)
+      : file(std::move(file_)),
+        bytes(file->data()),
+        length(file->size()),
+        hash(Hasher::hash(bytes, length)) {}
+
+  // Either loads the file, or returns a string error
+  static std::variant<std::shared_ptr<const RomImage>, std::string> load(
+      const std::string &filename) {
+    auto result = MappedFile::open(filename);
+    if (std::holds_alternative<std::string>(result)) {
+      return std::get<std::string>(result);
+    }
+    return std::make_shared<const RomImage>(
+        std::move(std::get<std::unique_ptr<MappedFile>>(result)));
+  }
+
+  uint8_t operator[](size_t i) const { return bytes[i]; }
+  const uint8_t *data() const { return bytes; }
+  size_t size() const { return length; }
+
+  // Hasher::hash of the contents, which identifies the cartridge
+  uint64_t getHash() const { return hash; }
+
+ private:
+  std::unique_ptr<MappedFile> file;
+
+  // Copied out of file so reads don't have to go through it
+  const uint8_t *bytes;
+  size_t length;
+
+  uint64_t hash;
+};
+
+#endif  // DODO_ROM_IMAGE_H_
@@ -0,0 +1,48 @@
+#ifndef DODO_RTC_CLOCK_H_
+#define DODO_RTC_CLOCK_H_
+
+#include <chrono>
+#include <cstdint>
+
+// Where a cartridge's real-time clock gets the time from
+enum class RtcMode {
+  // The seed plus the emulated time since power on, so the clock keeps pace
+  // with the game at any speed, and replays and save states see the same
+  // times. Reading it costs no system call.
+  kEmulated,
+  // The host's clock, so a game's clock stays right however fast it's run
+  kWallClock,
+};
+
+// The time for cartridge clocks, in seconds since the Unix epoch
+class RtcClock {
+ public:
+  explicit RtcClock(const uint64_t &elapsed_dots_)
+      : mode(RtcMode::kEmulated), seed(0), elapsed_dots(elapsed_dots_) {}
+
+  uint64_t now() const {
+    if (mode == RtcMode::kWallClock) return wallClockSeconds();
+    return seed + elapsed_dots / kDotsPerSecond;
+  }
+
+  // Seeds the emulated clock so it reads the host's time now
+  void seedFromWallClock() {
+    seed = wallClockSeconds() - elapsed_dots / kDotsPerSecond;
+  }
+
+  static uint64_t wallClockSeconds() {
+    const auto epoch = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::seconds>(epoch).count());
+  }
+
+  RtcMode mode;
+  uint64_t seed;  // What the emulated clock read at power on
+
+ private:
+  static constexpr uint64_t kDotsPerSecond = 4194304;
+
+  const uint64_t &elapsed_dots;
+};
+
+#endif  // DODO_RTC_CLOCK_H_
@@ -0,0 +1,104 @@
+#ifndef DODO_SAVE_FILE_H_
+#define DODO_SAVE_FILE_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "paged_memory.h"
+
+// Keeps a cartridge's battery-backed RAM saved to disk while it runs.
+//
+// The MBC marks what it writes, and periodically hands over the RAM with
+// flush. Only the 8 KB banks that changed are copied, into a shadow of the
+// file, and a background thread writes that out. Each write goes to a
+// temporary file that's synced to disk and then renamed over the save, so a
+// crash at any point leaves either the old save or the new one.
+class SaveFile {
+ public:
+  // Changes are tracked in banks, which are RAM's pages
+  static constexpr size_t kBankSize = 0x2000;
+
+  SaveFile(std::string filename_, size_t ram_size);
+
+  // Writes anything still pending before returning
+  ~SaveFile();
+
+  SaveFile(const SaveFile &) = delete;
+  SaveFile &operator=(const SaveFile &) = delete;
+
+  // Returns the save's current contents, or nothing if there isn't one yet
+  std::vector<uint8_t> load();
+
+  // Marks the byte of RAM at offset as changed
+  void markDirty(size_t offset) {
+    if (replaced) markAllDirty();
+    dirty_banks[offset / kBankSize] = true;
+    dirty = true;
+  }
+  // Marks something stored after the RAM (e.g. the RTC) as changed
+  void markDirty() {
+    if (replaced) markAllDirty();
+    dirty = true;
+  }
+
+  // Notes that RAM was replaced without the game writing it, e.g. by
+  // loading a state, which alone mustn't overwrite the save. The next change
+  // the game makes saves all of RAM, so the file never mixes banks from
+  // before and after. Anything marked before is forgotten, so flush first.
+  void markReplaced() {
+    std::fill(dirty_banks.begin(), dirty_banks.end(), false);
+    dirty = false;
+    replaced = true;
+  }
+
+  // Hands ram, followed by trailer, to the writer if anything has changed.
+  // Unless forced, this does nothing until a second has passed since the
+  // last flush, so it may be called often (e.g. every frame). Changes made
+  // meanwhile wait for the first call after that.
+  void flush(const PagedMemory<kBankSize> &ram,
+             const std::vector<uint8_t> &trailer = {}, bool force = false);
+
+  // Whether flush would do anything, for callers that build a trailer
+  bool isFlushDue(bool force) const {
+    return dirty && (force || std::chrono::steady_clock::now() - last_flush >=
+                                  kFlushInterval);
+  }
+
+ private:
+  static constexpr auto kFlushInterval = std::chrono::seconds(1);
+
+  std::string filename;
+
+  // Only touched by the emulation thread
+  std::vector<bool> dirty_banks;
+  bool dirty;
+  bool replaced;
+  std::chrono::steady_clock::time_point last_flush;
+
+  // What the file should contain, guarded by mutex
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::vector<uint8_t> shadow;
+  bool pending;
+  bool stop;
+
+  // Started on the first flush, so saves that never change cost nothing
+  std::thread thread;
+
+  void markAllDirty() {
+    std::fill(dirty_banks.begin(), dirty_banks.end(), true);
+    replaced = false;
+  }
+
+  void run();
+  bool write(const std::vector<uint8_t> &data);
+};
+
+#endif  // DODO_SAVE_FILE_H_
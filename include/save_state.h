@@ -0,0 +1,120 @@
+#ifndef DODO_SAVE_STATE_H_
+#define DODO_SAVE_STATE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// Save states are the raw bytes of each component's fields and memory, in a
+// fixed order, so saving and loading are little more than a series of
+// memcpys. Values are stored in host byte order. Bump this whenever the
+// layout of any component's state changes.
+const uint32_t kStateVersion = 3;
+
+// Appends state to a buffer, reusing its capacity so saving every frame
+// doesn't allocate
+class StateWriter {
+ public:
+  explicit StateWriter(std::vector<uint8_t> &out_) : out(out_) { out.clear(); }
+
+  void write(const void *data, size_t size) {
+    const size_t at = out.size();
+    out.resize(at + size);
+    std::memcpy(out.data() + at, data, size);
+  }
+
+  template <typename T>
+  void writeValue(const T &value) {
+    static_assert(std::is_scalar_v<T>, "Only write values without padding");
+    write(&value, sizeof(value));
+  }
+
+  // Writes 7 bits per byte, low first, with the top bit set on all but the
+  // last, so small values take a single byte
+  void writeVarint(uint64_t value) {
+    while (value >= 0x80) {
+      out.push_back(static_cast<uint8_t>(value | 0x80));
+      value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+  }
+
+ private:
+  std::vector<uint8_t> &out;
+};
+
+// Reads state back in the order it was written. Reading past the end
+// fills with zeroes and marks the reader as failed, rather than throwing.
+class StateReader {
+ public:
+  StateReader(const uint8_t *data_, size_t size_)
+      : data(data_), size(size_), pos(0), failed(false) {}
+
+  void read(void *dst, size_t n) {
+    if (n > size - pos) {
+      failed = true;
+      std::memset(dst, 0, n);
+      return;
+    }
+    std::memcpy(dst, data + pos, n);
+    pos += n;
+  }
+
+  // Returns the next n bytes in place, or null if there aren't enough
+  const uint8_t *take(size_t n) {
+    if (n > size - pos) {
+      failed = true;
+      return nullptr;
+    }
+    pos += n;
+    return data + pos - n;
+  }
+
+  template <typename T>
+  void readValue(T &value) {
+    static_assert(std::is_scalar_v<T>, "Only read values without padding");
+    if constexpr (std::is_same_v<T, bool>) {
+      // Any other byte in a bool's place would be undefined behaviour
+      uint8_t byte;
+      read(&byte, 1);
+      value = byte != 0;
+    } else {
+      read(&value, sizeof(value));
+    }
+  }
+
+  // Reads an enum written with writeValue, giving fallback for anything
+  // past last, so a corrupt state can't make one out of range
+  template <typename T>
+  T readEnum(T last, T fallback) {
+    static_assert(std::is_enum_v<T>, "Only read enums");
+    std::underlying_type_t<T> raw;
+    read(&raw, sizeof(raw));
+    const int64_t value = raw;
+    if (value < 0 || value > static_cast<int64_t>(last)) return fallback;
+    return static_cast<T>(raw);
+  }
+
+  uint64_t readVarint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      const uint8_t *byte = take(1);
+      if (!byte) return 0;
+      value |= static_cast<uint64_t>(*byte & 0x7F) << shift;
+      if (!(*byte & 0x80)) break;
+    }
+    return value;
+  }
+
+  bool ok() const { return !failed; }
+  size_t remaining() const { return size - pos; }
+
+ private:
+  const uint8_t *data;
+  size_t size, pos;
+  bool failed;
+};
+
+#endif  // DODO_SAVE_STATE_H_
@@ -0,0 +1,45 @@
+#ifndef DODO_SNAPSHOT_CACHE_H_
+#define DODO_SNAPSHOT_CACHE_H_
+
+#include <cstdint>
+#include <initializer_list>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "gameboy.h"
+
+// States saved after the first frames of a run, so later runs that start
+// the same way can skip straight past them, e.g. past a game's intro.
+//
+// Each snapshot is a file in the cache's directory, named for a key made
+// from everything that decides the state: the cartridge and its battery
+// save, or the starting state, the input, and how many frames were run.
+// Loading maps the file, so it costs little more than copying the state in.
+// A snapshot from an older version is rejected by the state loader, and is
+// simply replaced.
+class SnapshotCache {
+ public:
+  explicit SnapshotCache(std::string directory_)
+      : directory(std::move(directory_)) {}
+
+  static uint64_t makeKey(std::initializer_list<uint64_t> parts);
+
+  // Loads the snapshot for key into gameboy, with the extra data stored
+  // alongside it, returning whether there was a usable one
+  bool load(uint64_t key, Gameboy &gameboy, std::vector<uint8_t> &extra);
+
+  // Saves gameboy's state and extra data as the snapshot for key, returning
+  // an error string on failure. The file is written under a temporary name
+  // and renamed, so another run never sees half a snapshot.
+  std::optional<std::string> store(uint64_t key, Gameboy &gameboy,
+                                   const std::vector<uint8_t> &extra);
+
+ private:
+  std::string directory;
+  std::vector<uint8_t> state;
+
+  std::string filename(uint64_t key) const;
+};
+
+#endif  // DODO_SNAPSHOT_CACHE_H_
@@ -0,0 +1,57 @@
+#ifndef DODO_SPSC_QUEUE_H_
+#define DODO_SPSC_QUEUE_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// A fixed-capacity lock-free single-producer/single-consumer queue.
+// Capacity must be a power of two. Neither side blocks; callers decide
+// whether to spin, yield or wait when the queue is full or empty.
+template <typename T, size_t Capacity>
+class SpscQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "SpscQueue capacity must be a power of two");
+
+ public:
+  SpscQueue() : slots(), head(0), tail(0) {}
+
+  // Producer side
+  bool push(const T &item) {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == Capacity) return false;
+    slots[t & (Capacity - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side
+  bool pop(T &item) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return false;
+    item = slots[h & (Capacity - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  uint64_t size() const {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
+  }
+  bool empty() const { return size() == 0; }
+
+  // The total number of items ever pushed. Consumers can wait on this with
+  // waitForPush, and producers must call notifyPush to wake them.
+  uint64_t pushedCount() const { return tail.load(std::memory_order_acquire); }
+  void waitForPush(uint64_t seen) const { tail.wait(seen); }
+  void notifyPush() { tail.notify_one(); }
+
+ private:
+  std::array<T, Capacity> slots;
+
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+};
+
+#endif  // DODO_SPSC_QUEUE_H_
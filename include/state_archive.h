@@ -0,0 +1,145 @@
+#ifndef DODO_STATE_ARCHIVE_H_
+#define DODO_STATE_ARCHIVE_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include "gameboy.h"
+#include "mapped_file.h"
+#include "spsc_queue.h"
+
+// Archives of a long session's states, each with the input that led to it.
+//
+// States are compressed as deltas (see state_delta.h) from the one before,
+// with a keyframe every so often, compressed against zeroes, so reading one
+// never has far to go. After a header of "DODOARCH" and the version (u32),
+// each entry is:
+//   flags (u8, bit 0 set for a keyframe), frame number (u64),
+//   state size (varint), input size (varint), input,
+//   delta size (varint), delta
+// An index of every entry's frame number and offset (u64s) follows, then
+// the entry count, the index's offset and "DODOAIDX". An archive cut off
+// before its index is still readable, by scanning its entries.
+// Values are in host byte order, like save states.
+
+// Appends to an archive on a background thread, so the emulation thread
+// only copies each state out
+class StateArchiveWriter {
+ public:
+  // Either creates the archive, or returns a string error. Every
+  // keyframe_interval'th entry is a keyframe.
+  static std::variant<std::unique_ptr<StateArchiveWriter>, std::string>
+  create(const std::string &filename, int keyframe_interval);
+
+  // Finishes writing everything appended so far
+  ~StateArchiveWriter();
+
+  StateArchiveWriter(const StateArchiveWriter &) = delete;
+  StateArchiveWriter &operator=(const StateArchiveWriter &) = delete;
+
+  // Saves gameboy's state as the given frame's, with the input since the
+  // last entry. This never waits: if the writer has fallen so far behind
+  // that no buffer is free, the entry is dropped and false returned, and its
+  // input should be passed again with the next.
+  bool append(Gameboy &gameboy, uint64_t frame, const uint8_t *input,
+              size_t input_size);
+
+  uint64_t getDropped() const { return dropped; }
+
+  // Waits for the writer to finish and writes the index, returning an error
+  // string if anything failed to be written
+  std::optional<std::string> close();
+
+ private:
+  static constexpr size_t kBuffers = 8;
+
+  struct Job {
+    bool stop;
+    uint64_t frame;
+    std::vector<uint8_t> state, input;
+  };
+
+  std::array<Job, kBuffers> jobs;
+  SpscQueue<uint32_t, kBuffers> free_jobs;   // Returned by the writer
+  SpscQueue<uint32_t, kBuffers> ready_jobs;  // Filled by the producer
+  uint64_t dropped;
+
+  std::ofstream file;
+  int keyframe_interval;
+
+  // Only touched by the writer thread
+  struct IndexEntry {
+    uint64_t frame, offset;
+  };
+  std::vector<IndexEntry> index;
+  uint64_t offset;              // Where the next entry goes
+  std::vector<uint8_t> last;    // The last state written
+  std::vector<uint8_t> zeroes;  // What keyframes are compressed against
+  std::vector<uint8_t> delta;
+  std::vector<uint8_t> record;
+
+  std::thread thread;
+
+  explicit StateArchiveWriter(int keyframe_interval_);
+
+  void submitJob(uint32_t job);
+  void run();
+  void writeEntry(const Job &job);
+  void writeIndex();
+  void writeBytes(const std::vector<uint8_t> &bytes);
+};
+
+// Reads any entry of an archive, going from the keyframe before it
+class StateArchiveReader {
+ public:
+  // Either opens the archive, or returns a string error
+  static std::variant<std::unique_ptr<StateArchiveReader>, std::string> open(
+      const std::string &filename);
+
+  size_t size() const { return entries.size(); }
+  uint64_t getFrame(size_t n) const { return entries[n].frame; }
+
+  // The last entry at or before the given frame, if there is one. Frame
+  // numbers must go up from entry to entry.
+  std::optional<size_t> find(uint64_t frame) const;
+
+  // Decodes entry n's state into out, returning false if it's corrupt
+  bool readState(size_t n, std::vector<uint8_t> &out) const;
+
+  // Copies the input recorded with entry n into out
+  void readInput(size_t n, std::vector<uint8_t> &out) const;
+
+ private:
+  struct IndexEntry {
+    uint64_t frame;
+    size_t offset;
+  };
+
+  // An entry's fields, pointing into the file
+  struct Entry {
+    bool keyframe;
+    size_t state_size;
+    const uint8_t *input, *delta;
+    size_t input_size, delta_size;
+  };
+
+  std::unique_ptr<MappedFile> file;
+  std::vector<IndexEntry> entries;
+
+  StateArchiveReader() {}
+
+  bool readIndex();
+  void scanEntries();
+  bool parseEntry(size_t offset, uint64_t &frame, Entry &entry,
+                  size_t &end) const;
+};
+
+#endif  // DODO_STATE_ARCHIVE_H_
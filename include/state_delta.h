@@ -0,0 +1,23 @@
+#ifndef DODO_STATE_DELTA_H_
+#define DODO_STATE_DELTA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Compact differences between two save states of the same size. The states
+// are XORed, which leaves zeroes wherever memory didn't change, and the
+// result is stored as alternating runs of unchanged bytes (as a length) and
+// changed ones (as their XOR), with lengths as varints. Frame to frame,
+// most of a state doesn't change, so a delta is usually a few KB. Against
+// an all-zero state, the same encoding just run-length encodes zeroes.
+
+// Encodes a ^ b into out, replacing its contents
+void encodeDelta(const uint8_t *a, const uint8_t *b, size_t size,
+                 std::vector<uint8_t> &out);
+
+// XORs an encoded delta into state, turning one side into the other
+void applyDelta(const uint8_t *delta, size_t delta_size, uint8_t *state,
+                size_t size);
+
+#endif  // DODO_STATE_DELTA_H_
@@ -0,0 +1,56 @@
+#ifndef DODO_THREAD_POOL_H_
+#define DODO_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A fixed set of worker threads for splitting data-parallel work into chunks.
+// Several threads may submit work at once; each submitter also runs chunks of
+// its own work while it waits, so a pool with no threads still works.
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t n_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // A process-wide pool with one thread per extra hardware thread
+  static ThreadPool &shared();
+
+  size_t size() const { return threads.size(); }
+
+  // Splits [0, n) into n_chunks contiguous ranges and calls func(begin, end)
+  // for each, returning once all of them are done
+  void parallelFor(size_t n, size_t n_chunks,
+                   const std::function<void(size_t, size_t)> &func);
+
+ private:
+  struct Batch {
+    const std::function<void(size_t, size_t)> &func;
+    size_t n, n_chunks;
+    size_t next_chunk, done_chunks;
+  };
+
+  std::mutex mutex;
+  std::condition_variable work_cv, done_cv;
+  std::deque<Batch *> batches;  // Batches with chunks left to claim
+  bool stopping;
+
+  std::vector<std::thread> threads;
+
+  // Claims a chunk of the oldest batch, returning the batch and chunk index.
+  // Must be called with the mutex held and a batch available.
+  std::pair<Batch *, size_t> claimChunk();
+  void runChunk(std::unique_lock<std::mutex> &lock, Batch &batch,
+                size_t chunk);
+  void run();
+};
+
+#endif  // DODO_THREAD_POOL_H_
@@ -2,31 +2,67 @@
 #define DODO_TIMER_H_
 
 #include <cstdint>
+#include <limits>
+
+#include "hash.h"
+#include "save_state.h"
 
 const int kClockStep[4] = {1024, 16, 64, 256};
 
+const uint64_t kNever = std::numeric_limits<uint64_t>::max();
+
+// DIV and TIMA are derived from an absolute count of CPU ticks rather than
+// stepped, so the timer only needs to run when its registers are accessed or
+// TIMA overflows, and any amount of time passes in O(1).
 class Timer {
  public:
   Timer()
-      : divider(),
+      : now(0),
+        div_origin(0),
         counter(),
         modulo(),
-        cpu_tick_divider(),
+        counter_time(0),
+        counter_divider(0),
         enable(),
-        clock_select() {}
+        clock_select(),
+        next_overflow(kNever) {}
 
-  bool tick(int cpu_ticks);
+  // Brings the timer up to the given tick count, returning whether TIMA
+  // overflowed along the way. Must be called before reads and writes.
+  bool update(uint64_t now_);
 
-  uint8_t read(uint16_t addr);
+  // The tick count at which TIMA will next overflow, or kNever
+  uint64_t nextOverflow() const { return next_overflow; }
+
+  uint8_t read(uint16_t addr) const;
   void write(uint16_t addr, uint8_t data);
 
+  void hashState(Hasher &hasher) const;
+
+  // The next overflow is recomputed on load rather than stored
+  void saveState(StateWriter &writer) const;
+  void loadState(StateReader &reader);
+
  private:
-  uint8_t divider, counter, modulo;
-  int cpu_tick_divider, counter_divider;
+  uint64_t now;  // As of the last update
+
+  // DIV counts up every 256 ticks from here
+  uint64_t div_origin;
+
+  // TIMA as of counter_time, with counter_divider ticks towards its next
+  // increment. It only advances while enabled.
+  uint8_t counter, modulo;
+  uint64_t counter_time;
+  uint64_t counter_divider;
   bool enable;
   uint8_t clock_select;
 
-  int getClockStep() const { return kClockStep[clock_select]; }
+  uint64_t next_overflow;
+
+  uint64_t getClockStep() const {
+    return static_cast<uint64_t>(kClockStep[clock_select]);
+  }
+  void scheduleOverflow();
 };
 
 #endif  // DODO_TIMER_H_
@@ -0,0 +1,52 @@
+#ifndef DODO_TRIPLE_BUFFER_H_
+#define DODO_TRIPLE_BUFFER_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// A lock-free single-producer/single-consumer triple buffer.
+// The producer always owns a back buffer to write into, and publish() swaps it
+// with the "ready" slot. The consumer swaps the ready slot into its front
+// buffer whenever a newer one has been published, so neither side ever waits
+// on the other and the consumer never sees a partially written buffer.
+template <typename T>
+class TripleBuffer {
+ public:
+  TripleBuffer() : buffers(), back(0), ready(1), front(2) {}
+
+  // Producer side
+  T &getBack() { return buffers[back]; }
+  const T &getBack() const { return buffers[back]; }
+
+  // Producer side: makes the back buffer the latest completed one
+  void publish() {
+    back = ready.exchange(back | kFreshBit, std::memory_order_acq_rel) &
+           kIndexMask;
+  }
+
+  // Consumer side: moves the latest published buffer to the front,
+  // returning whether there was a new one
+  bool acquire() {
+    if ((ready.load(std::memory_order_relaxed) & kFreshBit) == 0) return false;
+    front = ready.exchange(front, std::memory_order_acq_rel) & kIndexMask;
+    return true;
+  }
+
+  // Consumer side
+  const T &getFront() const { return buffers[front]; }
+
+ private:
+  static constexpr uint8_t kIndexMask = 0b11;
+  static constexpr uint8_t kFreshBit = 0b100;
+
+  std::array<T, 3> buffers;
+
+  // Each index is touched by a different thread, so keep them on separate
+  // cache lines
+  alignas(64) uint8_t back;
+  alignas(64) std::atomic<uint8_t> ready;
+  alignas(64) uint8_t front;
+};
+
+#endif  // DODO_TRIPLE_BUFFER_H_
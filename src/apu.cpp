@@ -0,0 +1,418 @@
+#include "apu.h"
+
+#include <algorithm>
+
+namespace {
+
+// Bits that always read as 1, as they're write-only or unused
+const uint8_t kReadMask[0x30] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,  // NR10-NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,  // NR20-NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,  // NR30-NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,  // NR40-NR44
+    0x00, 0x00, 0x70,              // NR50-NR52
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+const uint8_t kDutyPatterns[4] = {0b00000001, 0b10000001, 0b10000111,
+                                  0b01111110};
+
+const size_t kNR50 = 0x14;
+const size_t kNR51 = 0x15;
+const size_t kNR52 = 0x16;
+const size_t kWaveRam = 0x20;
+
+const uint32_t kSequencerPeriod = 8192;
+
+// Enough for a few frames at any sensible sample rate
+const size_t kBufferCapacity = 16384;
+
+}  // namespace
+
+Apu::Apu()
+    : regs(),
+      power(true),
+      synthesis(false),
+      channels(),
+      sweep_shadow(0),
+      sweep_timer(0),
+      sweep_enabled(false),
+      sequencer_timer(kSequencerPeriod),
+      sequencer_step(0),
+      time(0),
+      left(kApuClockRate, kDefaultSampleRate, kBufferCapacity),
+      right(kApuClockRate, kDefaultSampleRate, kBufferCapacity) {}
+
+void Apu::run(int ticks) {
+  const uint32_t end = time + static_cast<uint32_t>(ticks);
+  while (time < end) {
+    const uint32_t next = std::min(end, time + sequencer_timer);
+    if (synthesis && power) {
+      for (size_t i = 0; i < 4; i++) runChannel(i, time, next);
+    }
+    sequencer_timer -= next - time;
+    time = next;
+
+    if (sequencer_timer == 0) {
+      sequencer_timer = kSequencerPeriod;
+      if (power) {
+        clockSequencer();
+        updateOutputs(time);
+      }
+    }
+  }
+
+  if (synthesis) {
+    // Drop the oldest audio if nobody is reading it
+    const size_t limit = left.getCapacity() / 2;
+    if (left.samplesAvailable() > limit) {
+      left.removeSamples(left.samplesAvailable() - limit);
+      right.removeSamples(right.samplesAvailable() - limit);
+    }
+    left.endFrame(time);
+    right.endFrame(time);
+  }
+  time = 0;
+}
+
+uint8_t Apu::read(uint16_t addr) const {
+  const size_t index = addr - 0xFF10;
+  if (index == kNR52) {
+    uint8_t status = static_cast<uint8_t>(power << 7) | kReadMask[kNR52];
+    for (size_t i = 0; i < 4; i++) {
+      status |= static_cast<uint8_t>(channels[i].enabled << i);
+    }
+    return status;
+  }
+  return regs[index] | kReadMask[index];
+}
+
+void Apu::write(uint16_t addr, uint8_t data) {
+  const size_t index = addr - 0xFF10;
+  if (index >= kWaveRam) {
+    regs[index] = data;
+    updateOutput(2, time);
+    return;
+  }
+
+  if (index == kNR52) {
+    const bool on = data >> 7;
+    if (power && !on) {
+      // Powering off clears every register and silences every channel
+      std::fill(regs.begin(), regs.begin() + kNR52, 0);
+      for (auto &channel : channels) {
+        channel.enabled = false;
+        channel.length_enabled = false;
+        channel.length = 0;
+      }
+    } else if (!power && on) {
+      sequencer_step = 0;
+    }
+    power = on;
+    updateOutputs(time);
+    return;
+  }
+
+  if (!power || index > kNR52) return;
+  regs[index] = data;
+
+  if (index == kNR50 || index == kNR51) {
+    updateOutputs(time);
+    return;
+  }
+
+  const size_t channel = index / 5;
+  switch (index % 5) {
+    case 0:
+      if (channel == 2 && !dacEnabled(2)) channels[2].enabled = false;
+      break;
+    case 1:
+      channels[channel].length =
+          channel == 2 ? 256 - data : 64 - (data & 0x3F);
+      break;
+    case 2:
+      if (channel != 2 && !dacEnabled(channel)) {
+        channels[channel].enabled = false;
+      }
+      break;
+    case 3:
+      // The new frequency takes effect when the timer next reloads
+      break;
+    case 4:
+      channels[channel].length_enabled = data & 0x40;
+      if (data & 0x80) trigger(channel);
+      break;
+  }
+  updateOutput(channel, time);
+}
+
+void Apu::setSynthesis(bool enabled) {
+  if (enabled == synthesis) return;
+
+  // Step the buffers down to silence when turning off, and back up to the
+  // current levels when turning on. Time doesn't pass in the buffers while
+  // synthesis is off, so the two steps land together, and turning it off
+  // and on again between frames (e.g. for run-ahead) is seamless.
+  for (auto &channel : channels) {
+    if (synthesis) {
+      left.addDelta(time, -channel.left);
+      right.addDelta(time, -channel.right);
+    }
+    channel.left = channel.right = 0;
+  }
+  synthesis = enabled;
+  if (enabled) updateOutputs(time);
+}
+
+void Apu::setSampleRate(double sample_rate) {
+  left.setRates(kApuClockRate, sample_rate);
+  right.setRates(kApuClockRate, sample_rate);
+}
+
+size_t Apu::readSamples(int16_t *out, size_t max_frames) {
+  const size_t n = std::min(max_frames, samplesAvailable());
+  left.readSamples(out, n, 2);
+  right.readSamples(out + 1, n, 2);
+  return n;
+}
+
+void Apu::hashState(Hasher &hasher) const {
+  hasher.update(regs.data(), regs.size());
+  hasher.updateValue(power);
+  for (const auto &channel : channels) {
+    hasher.updateValue(channel.enabled);
+    hasher.updateValue(channel.length_enabled);
+    hasher.updateValue(channel.length);
+    hasher.updateValue(channel.volume);
+    hasher.updateValue(channel.envelope_timer);
+  }
+  hasher.updateValue(sweep_shadow);
+  hasher.updateValue(sweep_timer);
+  hasher.updateValue(sweep_enabled);
+  hasher.updateValue(sequencer_timer);
+  hasher.updateValue(sequencer_step);
+}
+
+void Apu::saveState(StateWriter &writer) const {
+  writer.write(regs.data(), regs.size());
+  writer.writeValue(power);
+  for (const auto &channel : channels) {
+    writer.writeValue(channel.enabled);
+    writer.writeValue(channel.length_enabled);
+    writer.writeValue(channel.length);
+    writer.writeValue(channel.volume);
+    writer.writeValue(channel.envelope_timer);
+    writer.writeValue(channel.timer);
+    writer.writeValue(channel.position);
+    writer.writeValue(channel.lfsr);
+  }
+  writer.writeValue(sweep_shadow);
+  writer.writeValue(sweep_timer);
+  writer.writeValue(sweep_enabled);
+  writer.writeValue(sequencer_timer);
+  writer.writeValue(sequencer_step);
+}
+
+void Apu::loadState(StateReader &reader) {
+  reader.read(regs.data(), regs.size());
+  reader.readValue(power);
+  for (auto &channel : channels) {
+    reader.readValue(channel.enabled);
+    reader.readValue(channel.length_enabled);
+    reader.readValue(channel.length);
+    reader.readValue(channel.volume);
+    reader.readValue(channel.envelope_timer);
+    reader.readValue(channel.timer);
+    reader.readValue(channel.position);
+    reader.readValue(channel.lfsr);
+    channel.position &= 31;  // It indexes wave RAM
+  }
+  reader.readValue(sweep_shadow);
+  reader.readValue(sweep_timer);
+  reader.readValue(sweep_enabled);
+  reader.readValue(sequencer_timer);
+  reader.readValue(sequencer_step);
+
+  // A zero timer would never clock the sequencer again
+  if (sequencer_timer == 0 || sequencer_timer > kSequencerPeriod) {
+    sequencer_timer = kSequencerPeriod;
+  }
+  // Step the buffers from whatever was playing to the loaded levels
+  updateOutputs(time);
+}
+
+bool Apu::dacEnabled(size_t channel) const {
+  if (channel == 2) return reg(2, 0) & 0x80;
+  return reg(channel, 2) & 0xF8;
+}
+
+uint32_t Apu::period(size_t channel) const {
+  switch (channel) {
+    case 0:
+    case 1:
+      // 8 duty steps per wave
+      return (2048u - frequency(channel)) * 4;
+    case 2:
+      // 32 samples per wave
+      return (2048u - frequency(2)) * 2;
+    default: {
+      const uint8_t nr43 = reg(3, 3);
+      const uint32_t divisor = (nr43 & 0b111) ? (nr43 & 0b111) * 16u : 8u;
+      return divisor << (nr43 >> 4);
+    }
+  }
+}
+
+void Apu::trigger(size_t channel) {
+  Channel &c = channels[channel];
+  c.enabled = dacEnabled(channel);
+  if (c.length == 0) c.length = channel == 2 ? 256 : 64;
+  c.timer = period(channel);
+  c.position = 0;
+
+  if (channel != 2) {
+    c.volume = reg(channel, 2) >> 4;
+    c.envelope_timer = reg(channel, 2) & 0b111;
+  }
+  if (channel == 3) c.lfsr = 0x7FFF;
+
+  if (channel == 0) {
+    const uint8_t sweep_period = (reg(0, 0) >> 4) & 0b111;
+    const uint8_t shift = reg(0, 0) & 0b111;
+    sweep_shadow = frequency(0);
+    sweep_timer = sweep_period ? sweep_period : 8;
+    sweep_enabled = sweep_period || shift;
+    if (shift && sweepTarget() > 2047) c.enabled = false;
+  }
+}
+
+void Apu::clockSequencer() {
+  // Lengths on even steps, the sweep on 2 and 6, and envelopes on 7
+  if (sequencer_step % 2 == 0) {
+    for (auto &c : channels) {
+      if (c.length_enabled && c.length > 0 && --c.length == 0) {
+        c.enabled = false;
+      }
+    }
+  }
+
+  if (sequencer_step == 2 || sequencer_step == 6) clockSweep();
+
+  if (sequencer_step == 7) {
+    for (size_t channel : {0u, 1u, 3u}) {
+      Channel &c = channels[channel];
+      const uint8_t nrx2 = reg(channel, 2);
+      if ((nrx2 & 0b111) == 0) continue;
+
+      if (c.envelope_timer > 0) c.envelope_timer--;
+      if (c.envelope_timer == 0) {
+        c.envelope_timer = nrx2 & 0b111;
+        if ((nrx2 & 0b1000) && c.volume < 15) {
+          c.volume++;
+        } else if (!(nrx2 & 0b1000) && c.volume > 0) {
+          c.volume--;
+        }
+      }
+    }
+  }
+
+  sequencer_step = (sequencer_step + 1) & 0b111;
+}
+
+void Apu::clockSweep() {
+  if (sweep_timer > 0) sweep_timer--;
+  if (sweep_timer != 0) return;
+
+  const uint8_t sweep_period = (reg(0, 0) >> 4) & 0b111;
+  sweep_timer = sweep_period ? sweep_period : 8;
+  if (!sweep_enabled || sweep_period == 0) return;
+
+  const uint16_t target = sweepTarget();
+  if (target > 2047) {
+    channels[0].enabled = false;
+  } else if (reg(0, 0) & 0b111) {
+    sweep_shadow = target;
+    regs[3] = static_cast<uint8_t>(target);
+    regs[4] = static_cast<uint8_t>((regs[4] & ~0b111) | (target >> 8));
+    if (sweepTarget() > 2047) channels[0].enabled = false;
+  }
+}
+
+uint16_t Apu::sweepTarget() const {
+  const uint16_t delta = sweep_shadow >> (reg(0, 0) & 0b111);
+  return (reg(0, 0) & 0b1000) ? sweep_shadow - delta : sweep_shadow + delta;
+}
+
+void Apu::runChannel(size_t channel, uint32_t from, uint32_t to) {
+  Channel &c = channels[channel];
+  if (!c.enabled) return;
+  // The noise channel isn't clocked at all with the largest shifts
+  if (channel == 3 && (reg(3, 3) >> 4) >= 14) return;
+  if (c.timer == 0) c.timer = period(channel);
+
+  uint32_t t = from;
+  while (to - t >= c.timer) {
+    t += c.timer;
+    c.timer = period(channel);
+
+    if (channel == 3) {
+      const uint16_t bit = (c.lfsr ^ (c.lfsr >> 1)) & 1;
+      c.lfsr = static_cast<uint16_t>((c.lfsr >> 1) | (bit << 14));
+      if (reg(3, 3) & 0b1000) {
+        c.lfsr = static_cast<uint16_t>((c.lfsr & ~(1 << 6)) | (bit << 6));
+      }
+    } else {
+      c.position = (c.position + 1) & (channel == 2 ? 31 : 7);
+    }
+    updateOutput(channel, t);
+  }
+  c.timer -= to - t;
+}
+
+int Apu::channelOutput(size_t channel) const {
+  const Channel &c = channels[channel];
+  if (!power || !c.enabled) return 0;
+
+  switch (channel) {
+    case 0:
+    case 1:
+      return (kDutyPatterns[reg(channel, 1) >> 6] >> c.position) & 1
+                 ? c.volume
+                 : 0;
+    case 2: {
+      const uint8_t byte = regs[kWaveRam + c.position / 2];
+      const int sample = (c.position % 2) ? (byte & 0xF) : (byte >> 4);
+      const int volume_code = (reg(2, 2) >> 5) & 0b11;
+      return volume_code ? sample >> (volume_code - 1) : 0;
+    }
+    default:
+      return (c.lfsr & 1) ? 0 : c.volume;
+  }
+}
+
+void Apu::updateOutput(size_t channel, uint32_t at) {
+  if (!synthesis) return;
+
+  const int output = channelOutput(channel);
+  const uint8_t panning = regs[kNR51];
+  const uint8_t master = regs[kNR50];
+  const int l = ((panning >> (channel + 4)) & 1)
+                    ? output * (((master >> 4) & 0b111) + 1) * kAmplitude
+                    : 0;
+  const int r = ((panning >> channel) & 1)
+                    ? output * ((master & 0b111) + 1) * kAmplitude
+                    : 0;
+
+  Channel &c = channels[channel];
+  if (l != c.left) {
+    left.addDelta(at, l - c.left);
+    c.left = l;
+  }
+  if (r != c.right) {
+    right.addDelta(at, r - c.right);
+    c.right = r;
+  }
+}
+
+void Apu::updateOutputs(uint32_t at) {
+  for (size_t i = 0; i < 4; i++) updateOutput(i, at);
+}
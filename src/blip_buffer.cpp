@@ -0,0 +1,107 @@
+#include "blip_buffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+
+BlipBuffer::BlipBuffer(double clock_rate, double sample_rate, size_t capacity_)
+    : capacity(capacity_),
+      factor(0),
+      offset(0),
+      integrator(0),
+      deltas(capacity_ + kWidth, 0) {
+  setRates(clock_rate, sample_rate);
+}
+
+void BlipBuffer::setRates(double clock_rate, double sample_rate) {
+  factor = static_cast<uint64_t>(
+      std::llround(sample_rate / clock_rate * std::exp2(kFracBits)));
+}
+
+const BlipBuffer::Kernel &BlipBuffer::kernel() {
+  // A Blackman-windowed sinc with its cutoff just below the output Nyquist
+  // rate, sampled at each phase and normalized so a step sums to exactly 1
+  static const Kernel table = [] {
+    const double cutoff = 0.9;
+    const double half_width = kWidth / 2.0;
+
+    Kernel k;
+    for (size_t phase = 0; phase < k.size(); phase++) {
+      const double frac = static_cast<double>(phase) / k.size();
+      std::array<double, kWidth> taps;
+      double sum = 0;
+      for (size_t i = 0; i < kWidth; i++) {
+        const double t = static_cast<double>(i) - (half_width - 1) - frac;
+        const double x = std::numbers::pi * cutoff * t;
+        const double sinc = t == 0 ? 1 : std::sin(x) / x;
+        const double w = 2 * std::numbers::pi * (t + half_width) / kWidth;
+        const double window = 0.42 - 0.5 * std::cos(w) + 0.08 * std::cos(2 * w);
+        taps[i] = sinc * window;
+        sum += taps[i];
+      }
+
+      int32_t total = 0;
+      for (size_t i = 0; i < kWidth; i++) {
+        k[phase][i] = static_cast<int32_t>(
+            std::lround(taps[i] / sum * (1 << kKernelBits)));
+        total += k[phase][i];
+      }
+      // Put any rounding error on the largest tap
+      auto largest = std::max_element(k[phase].begin(), k[phase].end());
+      *largest += (1 << kKernelBits) - total;
+    }
+    return k;
+  }();
+  return table;
+}
+
+void BlipBuffer::addDelta(uint32_t time, int delta) {
+  const uint64_t pos = offset + time * factor;
+  const size_t index = pos >> kFracBits;
+  if (index >= capacity) return;
+
+  const size_t phase =
+      (pos >> (kFracBits - kPhaseBits)) & ((1 << kPhaseBits) - 1);
+  const auto &taps = kernel()[phase];
+  int64_t *out = &deltas[index];
+  for (size_t i = 0; i < kWidth; i++) {
+    out[i] += static_cast<int64_t>(taps[i]) * delta;
+  }
+}
+
+void BlipBuffer::endFrame(uint32_t time) {
+  offset += time * factor;
+
+  // Steps past the end were already dropped, so start over from silence
+  if (samplesAvailable() > capacity) {
+    for (int64_t delta : deltas) integrator += delta;
+    std::fill(deltas.begin(), deltas.end(), 0);
+    offset &= (uint64_t{1} << kFracBits) - 1;
+  }
+}
+
+size_t BlipBuffer::readSamples(int16_t *out, size_t n, size_t stride) {
+  n = std::min(n, samplesAvailable());
+  for (size_t i = 0; i < n; i++) {
+    integrator += deltas[i];
+    int64_t sample = integrator >> kKernelBits;
+    // Leak the integrator towards zero, which removes any DC offset
+    integrator -= sample << (kKernelBits - kBassShift);
+    if (out) {
+      out[i * stride] = static_cast<int16_t>(
+          std::clamp<int64_t>(sample, INT16_MIN, INT16_MAX));
+    }
+  }
+  shift(n);
+  return n;
+}
+
+void BlipBuffer::removeSamples(size_t n) { readSamples(nullptr, n, 0); }
+
+void BlipBuffer::shift(size_t n) {
+  const size_t remaining = samplesAvailable() - n + kWidth;
+  std::copy_n(deltas.begin() + static_cast<ptrdiff_t>(n), remaining,
+              deltas.begin());
+  std::fill_n(deltas.begin() + static_cast<ptrdiff_t>(remaining), n, 0);
+  offset -= n << kFracBits;
+}
@@ -4,21 +4,177 @@
 
 bool Bus::tick(int cpu_tcycles) {
   int cpu_multiplier = double_speed ? 2 : 1;
+  // HBlank DMA polls the PPU mode every step
+  if (hdma_mode == HdmaMode::kHdmaHBlank) syncPpu();
   int dma_ticks = progressDma();
   int ppu_ticks = cpu_tcycles / cpu_multiplier + dma_ticks;
   int cpu_ticks = cpu_tcycles + dma_ticks * cpu_multiplier;
 
-  bool timer_interrupt = timer.tick(cpu_ticks);
-  int_request |= timer_interrupt << kIntOffTimer;
+  cpu_ticks_total += static_cast<uint64_t>(cpu_ticks);
+  elapsed_dots += static_cast<uint64_t>(ppu_ticks);
+  if (cpu_ticks_total >= timer.nextOverflow()) syncTimer();
 
-  auto ppu_interrupts = ppu.tick(ppu_ticks);
-  int_request |= ppu_interrupts;
+  ppu_ticks_pending += ppu_ticks;
+  if (ppu_ticks_pending >= ppu_ticks_until_event) syncPpu();
+
+  apu_ticks_pending += ppu_ticks;
+  if (frame_ready || apu_ticks_pending >= kDotsPerFrame) syncApu();
 
   // TODO: Keypad and serial interrupts
 
   // TODO: Tick other devices
 
-  return ((ppu_interrupts >> kIntOffVBlank) & 1) == 1;
+  bool new_frame = frame_ready;
+  frame_ready = false;
+  if (new_frame && mbc) mbc->flushSave();
+  return new_frame;
+}
+
+void Bus::syncTimer() {
+  bool timer_interrupt = timer.update(cpu_ticks_total);
+  int_request |= timer_interrupt << kIntOffTimer;
+}
+
+void Bus::syncApu() {
+  apu.run(apu_ticks_pending);
+  apu_ticks_pending = 0;
+}
+
+void Bus::syncPpu() {
+  auto ppu_interrupts = ppu.tick(ppu_ticks_pending);
+  int_request |= ppu_interrupts;
+  frame_ready |= ((ppu_interrupts >> kIntOffVBlank) & 1) == 1;
+
+  ppu_ticks_pending = 0;
+  ppu_ticks_until_event = ppu.ticksUntilNextEvent();
+}
+
+void Bus::hashState(Hasher &hasher) {
+  syncPpu();
+  syncTimer();
+  syncApu();
+
+  wram.hashState(hasher);
+  hasher.update(hram.data(), hram.size());
+  hasher.update(serial_temp, sizeof(serial_temp));
+  hasher.updateValue(rtc_clock.seed);
+  if (mbc) mbc->hashState(hasher);
+  ppu.hashState(hasher);
+  timer.hashState(hasher);
+  apu.hashState(hasher);
+  hasher.updateValue(int_enable);
+  hasher.updateValue(int_request);
+  hasher.updateValue(double_speed);
+  hasher.updateValue(prepare_speed_switch);
+  hasher.updateValue(cgb_mode);
+  hasher.updateValue(wram_bank);
+  hasher.updateValue(hdma_mode);
+  hasher.update(hdma_src_dst, sizeof(hdma_src_dst));
+  hasher.updateValue(hdma_len);
+  hasher.updateValue(hdma_src);
+  hasher.updateValue(hdma_dst);
+  hasher.updateValue(select_action_buttons);
+  hasher.updateValue(select_dir_buttons);
+  hasher.updateValue(action_buttons_pressed);
+  hasher.updateValue(dir_buttons_pressed);
+}
+
+void Bus::saveState(StateWriter &writer) {
+  syncPpu();
+  syncTimer();
+  syncApu();
+
+  wram.saveState(writer);
+  if (mbc) mbc->saveState(writer);
+  saveDevices(writer);
+}
+
+void Bus::loadState(StateReader &reader) {
+  // Whatever was pending belongs to the state being replaced
+  syncApu();
+  ppu_ticks_pending = 0;
+
+  wram.loadState(reader);
+  if (mbc) mbc->loadState(reader);
+  loadDevices(reader);
+}
+
+void Bus::forkFrom(Bus &parent) {
+  parent.syncPpu();
+  parent.syncTimer();
+  parent.syncApu();
+  syncApu();
+  ppu_ticks_pending = 0;
+
+  wram.shareFrom(parent.wram);
+  mbc = parent.mbc ? parent.mbc->fork() : nullptr;
+  if (mbc) mbc->setRtcClock(&rtc_clock);
+  rtc_clock.mode = parent.rtc_clock.mode;
+
+  // Everything else is small enough to copy
+  StateWriter writer(fork_state);
+  parent.saveDevices(writer);
+  StateReader reader(fork_state.data(), fork_state.size());
+  loadDevices(reader);
+}
+
+void Bus::saveDevices(StateWriter &writer) const {
+  writer.write(hram.data(), hram.size());
+  writer.write(serial_temp, sizeof(serial_temp));
+  ppu.saveState(writer);
+  timer.saveState(writer);
+  apu.saveState(writer);
+  writer.writeValue(cpu_ticks_total);
+  writer.writeValue(elapsed_dots);
+  writer.writeValue(rtc_clock.seed);
+  writer.writeValue(frame_ready);
+  writer.writeValue(int_enable);
+  writer.writeValue(int_request);
+  writer.writeValue(double_speed);
+  writer.writeValue(prepare_speed_switch);
+  writer.writeValue(cgb_mode);
+  writer.writeValue(wram_bank);
+  writer.writeValue(hdma_mode);
+  writer.write(hdma_src_dst, sizeof(hdma_src_dst));
+  writer.writeValue(hdma_len);
+  writer.writeValue(hdma_src);
+  writer.writeValue(hdma_dst);
+  writer.writeValue(select_action_buttons);
+  writer.writeValue(select_dir_buttons);
+  writer.writeValue(action_buttons_pressed);
+  writer.writeValue(dir_buttons_pressed);
+}
+
+void Bus::loadDevices(StateReader &reader) {
+  reader.read(hram.data(), hram.size());
+  reader.read(serial_temp, sizeof(serial_temp));
+  ppu.loadState(reader);
+  timer.loadState(reader);
+  apu.loadState(reader);
+  reader.readValue(cpu_ticks_total);
+  reader.readValue(elapsed_dots);
+  reader.readValue(rtc_clock.seed);
+  reader.readValue(frame_ready);
+  reader.readValue(int_enable);
+  reader.readValue(int_request);
+  reader.readValue(double_speed);
+  reader.readValue(prepare_speed_switch);
+  reader.readValue(cgb_mode);
+  reader.readValue(wram_bank);
+  hdma_mode = reader.readEnum(HdmaMode::kHdmaHBlank, HdmaMode::kHdmaNone);
+  reader.read(hdma_src_dst, sizeof(hdma_src_dst));
+  reader.readValue(hdma_len);
+  reader.readValue(hdma_src);
+  reader.readValue(hdma_dst);
+  reader.readValue(select_action_buttons);
+  reader.readValue(select_dir_buttons);
+  reader.readValue(action_buttons_pressed);
+  reader.readValue(dir_buttons_pressed);
+  wram_bank &= 0b111;
+  if (wram_bank == 0) wram_bank = 1;
+  hdma_len &= 0x7F;
+
+  ppu_ticks_until_event = ppu.ticksUntilNextEvent();
 }
 
 void Bus::reset(bool cgb_mode_) {
@@ -91,15 +247,17 @@ void Bus::write(uint16_t addr, uint8_t data) {
   if ((addr < 0x8000) || (addr >= 0xA000 && addr < 0xC000)) {
     if (mbc) mbc->write(addr, data);
   } else if (addr >= 0x8000 && addr < 0xA000) {
+    syncPpu();
     ppu.writeVram(addr, data);
   } else if (addr >= 0xC000 && addr < 0xD000) {
-    wram[addr - 0xC000] = data;
+    wram.write(addr - 0xC000, data);
   } else if (addr >= 0xD000 && addr < 0xE000) {
     size_t bank = 0x1000 * (cgb_mode ? wram_bank : 1);
-    wram[bank + (addr - 0xD000)] = data;
+    wram.write(bank + (addr - 0xD000), data);
   } else if (addr >= 0xE000 && addr < 0xFE00) {
     write(addr - 0x2000, data);
   } else if (addr >= 0xFE00 && addr < 0xFEA0) {
+    syncPpu();
     ppu.writeOam(addr, data);
   } else if (addr >= 0xFF00 && addr < 0xFF80) {
     ioWrite(addr, data);
@@ -126,14 +284,16 @@ uint8_t Bus::ioRead(uint16_t addr) {
     // TODO: Communication
     return serial_temp[addr - 0xFF01];
   } else if (addr >= 0xFF04 && addr <= 0xFF07) {
+    syncTimer();
     return timer.read(addr);
   } else if (addr == 0xFF0F) {
     return int_request;
-  } else if (addr >= 0xFF10 && addr <= 0xFF26) {
-    // TODO: Sound
-  } else if (addr >= 0xFF30 && addr <= 0xFF3F) {
-    // TODO :Waveform RAM
+  } else if (addr >= 0xFF10 && addr <= 0xFF3F) {
+    syncApu();
+    return apu.read(addr);
   } else if (addr >= 0xFF40 && addr <= 0xFF4B) {
+    // Only STAT and LY change on their own
+    if (addr == 0xFF41 || addr == 0xFF44) syncPpu();
     return ppu.read(addr);
   } else if (addr == 0xFF4D) {
     return static_cast<uint8_t>(double_speed << 7) | prepare_speed_switch;
@@ -164,17 +324,20 @@ void Bus::ioWrite(uint16_t addr, uint8_t data) {
     // TODO: Communication
     serial_temp[addr - 0xFF01] = data;
   } else if (addr >= 0xFF04 && addr <= 0xFF07) {
+    syncTimer();
     timer.write(addr, data);
   } else if (addr == 0xFF0F) {
     int_request = data;
-  } else if (addr >= 0xFF10 && addr <= 0xFF26) {
-    // TODO: Sound
-  } else if (addr >= 0xFF30 && addr <= 0xFF3F) {
-    // TODO :Waveform RAM
+  } else if (addr >= 0xFF10 && addr <= 0xFF3F) {
+    syncApu();
+    apu.write(addr, data);
   } else if (addr == 0xFF46) {
     oamdma(static_cast<uint16_t>(data) * 0x100);
   } else if (addr >= 0xFF40 && addr <= 0xFF4B) {
+    syncPpu();
     ppu.write(addr, data);
+    // The write may have enabled interrupts, so check again next step
+    ppu_ticks_until_event = 0;
   } else if (addr == 0xFF4D) {
     prepare_speed_switch = data & 1;
   } else if (addr == 0xFF4F) {
@@ -201,6 +364,7 @@ void Bus::ioWrite(uint16_t addr, uint8_t data) {
 
     hdma_mode = bit_7 ? HdmaMode::kHdmaHBlank : HdmaMode::kHdmaGeneral;
   } else if (addr >= 0xFF68 && addr <= 0xFF6B) {
+    syncPpu();
     ppu.write(addr, data);
   } else if (addr == 0xFF70) {
     wram_bank = data & 0b111;
@@ -221,6 +385,7 @@ int Bus::progressDma() {
 }
 
 int Bus::hdmaTransferLines(int n_lines /* = 1 */) {
+  syncPpu();
   for (int i = 0; i < n_lines; i++) {
     for (int j = 0; j < 0x10; j++) {
       ppu.writeVram(static_cast<uint16_t>(hdma_dst + j),
@@ -247,6 +412,7 @@ void Bus::switchSpeed() {
 }
 
 void Bus::oamdma(uint16_t addr) {
+  syncPpu();
   for (uint16_t i = 0; i < 0x9F; i++) {
     ppu.writeOam(0xFE00 + i, this->read(addr + i));
   }
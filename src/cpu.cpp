@@ -56,6 +56,34 @@ void Cpu::reset(bool cgb_mode) {
   hl.set(0x014D);
   pc.set(0x0100);
   sp.set(0xFFFE);
+  ime = false;
+  halted = false;
+}
+
+void Cpu::hashState(Hasher &hasher) const {
+  for (const CpuRegister *reg : {&af, &bc, &de, &hl, &sp, &pc}) {
+    hasher.updateValue(reg->get());
+  }
+  hasher.updateValue(ime);
+  hasher.updateValue(halted);
+}
+
+void Cpu::saveState(StateWriter &writer) const {
+  for (const CpuRegister *reg : {&af, &bc, &de, &hl, &sp, &pc}) {
+    writer.writeValue(reg->get());
+  }
+  writer.writeValue(ime);
+  writer.writeValue(halted);
+}
+
+void Cpu::loadState(StateReader &reader) {
+  for (CpuRegister *reg : {&af, &bc, &de, &hl, &sp, &pc}) {
+    uint16_t value;
+    reader.readValue(value);
+    reg->set(value);
+  }
+  reader.readValue(ime);
+  reader.readValue(halted);
 }
 
 bool Cpu::check_for_interrupt() {
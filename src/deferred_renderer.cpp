@@ -0,0 +1,62 @@
+#include "deferred_renderer.h"
+
+#include "thread_pool.h"
+
+DeferredRenderer::DeferredRenderer(const std::array<uint8_t, kVramSize> &vram_,
+                                   const std::array<uint8_t, kOamSize> &oam_)
+    : vram(vram_), oam(oam_), renderer(vram, oam), writes_applied(0) {
+  lines.reserve(144);
+}
+
+void DeferredRenderer::endFrame(Frame &frame, bool render) {
+  if (render) {
+    ThreadPool &pool = ThreadPool::shared();
+    size_t run_start = 0;
+    while (run_start < lines.size()) {
+      size_t run_end = run_start + 1;
+      while (run_end < lines.size() &&
+             lines[run_end].writes_before == lines[run_start].writes_before) {
+        run_end++;
+      }
+
+      applyWrites(lines[run_start].writes_before);
+      renderer.updateSprites();
+      pool.parallelFor(run_end - run_start, pool.size() + 1,
+                       [&](size_t begin, size_t end) {
+                         for (size_t i = run_start + begin;
+                              i < run_start + end; i++) {
+                           const LineState &state = lines[i].state;
+                           renderer.drawLine(state, frame[state.lcd_y]);
+                         }
+                       });
+      run_start = run_end;
+    }
+  }
+
+  applyWrites(writes.size());
+  writes.clear();
+  writes_applied = 0;
+  lines.clear();
+}
+
+void DeferredRenderer::reload(const std::array<uint8_t, kVramSize> &vram_,
+                              const std::array<uint8_t, kOamSize> &oam_) {
+  vram = vram_;
+  oam = oam_;
+  renderer.invalidateSprites();
+  writes.clear();
+  writes_applied = 0;
+  lines.clear();
+}
+
+void DeferredRenderer::applyWrites(size_t writes_end) {
+  for (; writes_applied < writes_end; writes_applied++) {
+    const MemoryWrite &write = writes[writes_applied];
+    if (write.index & kOamFlag) {
+      oam[write.index & (kOamFlag - 1)] = write.data;
+      renderer.invalidateSprites();
+    } else {
+      vram[write.index] = write.data;
+    }
+  }
+}
@@ -0,0 +1,82 @@
+#include "frame_delta.h"
+
+#include <bitset>
+
+void FrameDeltaEncoder::encode(const PublishedFrame &frame,
+                               std::vector<uint8_t> &out) {
+  // If this directly follows the last frame encoded, the publisher already
+  // knows which lines changed. Otherwise frames were dropped in between, so
+  // compare against what the decoder has.
+  std::bitset<144> changed;
+  if (last_number == 0) {
+    changed.set();
+  } else if (frame.number == last_number) {
+    changed.reset();
+  } else if (frame.number == last_number + 1) {
+    changed = frame.dirty;
+  } else {
+    for (size_t y = 0; y < 144; y++) changed[y] = frame.pixels[y] != last[y];
+  }
+  last_number = frame.number;
+
+  for (int i = 0; i < 8; i++) {
+    out.push_back(static_cast<uint8_t>(frame.number >> (8 * i)));
+  }
+  const size_t n_runs_pos = out.size();
+  out.push_back(0);
+
+  size_t y = 0;
+  while (y < 144) {
+    if (!changed[y]) {
+      y++;
+      continue;
+    }
+
+    size_t first = y;
+    while (y < 144 && changed[y]) y++;
+    out[n_runs_pos]++;
+    out.push_back(static_cast<uint8_t>(first));
+    out.push_back(static_cast<uint8_t>(y - first));
+
+    for (size_t line = first; line < y; line++) {
+      for (uint16_t pixel : frame.pixels[line]) {
+        out.push_back(static_cast<uint8_t>(pixel));
+        out.push_back(static_cast<uint8_t>(pixel >> 8));
+      }
+      last[line] = frame.pixels[line];
+    }
+  }
+}
+
+std::optional<std::string> FrameDeltaDecoder::apply(const uint8_t *data,
+                                                    size_t size) {
+  if (size < 9) return "Frame delta is missing its header";
+
+  uint64_t new_number = 0;
+  for (int i = 0; i < 8; i++) {
+    new_number |= static_cast<uint64_t>(data[i]) << (8 * i);
+  }
+  size_t n_runs = data[8];
+  size_t pos = 9;
+
+  for (size_t run = 0; run < n_runs; run++) {
+    if (size - pos < 2) return "Frame delta run header is truncated";
+    size_t first = data[pos];
+    size_t n_lines = data[pos + 1];
+    pos += 2;
+
+    if (first + n_lines > 144) return "Frame delta run is out of range";
+    if (size - pos < n_lines * 160 * 2) return "Frame delta run is truncated";
+
+    for (size_t line = first; line < first + n_lines; line++) {
+      for (uint16_t &pixel : frame[line]) {
+        pixel = static_cast<uint16_t>(data[pos] | data[pos + 1] << 8);
+        pos += 2;
+      }
+    }
+  }
+
+  if (pos != size) return "Frame delta has trailing data";
+  number = new_number;
+  return std::nullopt;
+}
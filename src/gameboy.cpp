@@ -1,45 +1,140 @@
 #include "gameboy.h"
 
+#include <cstring>
 #include <fstream>
 #include <sstream>
 
+#include "mapped_file.h"
 #include "mbc/mbc0.h"
 #include "mbc/mbc1.h"
 #include "mbc/mbc3.h"
 #include "mbc/mbc5.h"
+#include "rom_cache.h"
 
 bool Gameboy::step() {
   int cpu_tcycles = cpu.step() * 4;
   return bus->tick(cpu_tcycles);
 }
 
-std::optional<std::string> Gameboy::loadCartridge(std::string filename) {
-  std::ifstream file(filename, std::ios::binary);
-  file.unsetf(std::ios::skipws);
-  if (file.fail()) {
-    return "Failed to open file: " + filename;
+uint64_t Gameboy::getStateHash() {
+  Hasher hasher;
+  cpu.hashState(hasher);
+  bus->hashState(hasher);
+  return hasher.digest();
+}
+
+uint64_t Gameboy::getCartridgeHash() const {
+  Hasher hasher;
+  hasher.updateValue(getRomHash());
+  bus->hashCartridge(hasher);
+  return hasher.digest();
+}
+
+namespace {
+
+const char kStateMagic[8] = {'D', 'O', 'D', 'O', 'S', 'T', 'A', 'T'};
+
+}  // namespace
+
+void Gameboy::saveState(std::vector<uint8_t> &out) {
+  StateWriter writer(out);
+  writer.write(kStateMagic, sizeof(kStateMagic));
+  writer.writeValue(kStateVersion);
+  writer.writeValue(getRomHash());
+  cpu.saveState(writer);
+  bus->saveState(writer);
+  state_size = out.size();
+}
+
+std::optional<std::string> Gameboy::loadState(const uint8_t *data,
+                                              size_t size) {
+  StateReader reader(data, size);
+  char magic[sizeof(kStateMagic)];
+  uint32_t version;
+  uint64_t rom_hash;
+  reader.read(magic, sizeof(magic));
+  reader.readValue(version);
+  reader.readValue(rom_hash);
+  if (!reader.ok() || std::memcmp(magic, kStateMagic, sizeof(magic)) != 0) {
+    return "Not a save state";
+  }
+  if (version != kStateVersion) {
+    return "Unsupported save state version";
+  }
+  if (rom_hash != getRomHash()) {
+    return "Save state is for a different cartridge";
   }
 
-  std::streampos file_size;
-  file.seekg(0, std::ios::end);
-  file_size = file.tellg();
-  file.seekg(0, std::ios::beg);
+  // Components read in place, so make sure every read will succeed first
+  if (state_size == 0) saveState(scratch_state);
+  if (size != state_size) {
+    return "Save state is the wrong size";
+  }
 
-  std::vector<uint8_t> data;
-  data.reserve(static_cast<size_t>(file_size));
+  cpu.loadState(reader);
+  bus->loadState(reader);
+  return {};
+}
 
-  data.insert(data.begin(), std::istream_iterator<uint8_t>(file),
-              std::istream_iterator<uint8_t>());
+std::optional<std::string> Gameboy::saveStateFile(
+    const std::string &filename) {
+  saveState(scratch_state);
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(scratch_state.data()),
+             static_cast<std::streamsize>(scratch_state.size()));
+  file.close();
+  if (file.fail()) return "Couldn't write save state: " + filename;
+  return {};
+}
+
+std::optional<std::string> Gameboy::loadStateFile(
+    const std::string &filename) {
+  auto file_result = MappedFile::open(filename);
+  if (std::holds_alternative<std::string>(file_result)) {
+    return std::get<std::string>(file_result);
+  }
+  const MappedFile &file = *std::get<0>(file_result);
+  return loadState(file.data(), file.size());
+}
+
+std::unique_ptr<Gameboy> Gameboy::fork() {
+  auto child = std::make_unique<Gameboy>();
+  forkInto(*child);
+  return child;
+}
+
+void Gameboy::forkInto(Gameboy &child) {
+  if (&child == this) return;
+
+  StateWriter writer(child.scratch_state);
+  cpu.saveState(writer);
+  StateReader reader(child.scratch_state.data(), child.scratch_state.size());
+  child.cpu.loadState(reader);
+
+  child.bus->forkFrom(*bus);
+  child.rom = rom;
+  child.state_size = state_size;
+}
+
+std::optional<std::string> Gameboy::loadCartridge(std::string filename) {
+  auto rom_result = RomCache::shared().load(filename);
+  if (std::holds_alternative<std::string>(rom_result)) {
+    return std::get<std::string>(rom_result);
+  }
+  std::shared_ptr<const RomImage> new_rom = std::get<0>(rom_result);
 
-  if (data.size() < 0x150) {
+  // The fixed bank and one switchable bank are read without bounds checks,
+  // which for a mapped file could fault rather than just read garbage
+  if (new_rom->size() < 0x8000) {
     return "File too small";
   }
 
   // Try to make an MBC of the correct type, otherwise return a string error
+  const RomImage &data = *new_rom;
   uint8_t mbc_type = data[0x147];
   const size_t ram_sizes[6] = {0, 0, 0x2000, 0x8000, 0x20000, 0x10000};
   size_t ram_size = ram_sizes[data[0x149]];
-  auto mbc_result = makeMbc(filename, mbc_type, ram_size, data);
+  auto mbc_result = makeMbc(filename, mbc_type, ram_size, new_rom);
   if (std::holds_alternative<std::unique_ptr<Mbc>>(mbc_result)) {
     bus->loadMbc(std::move(std::get<0>(mbc_result)));
   } else {
@@ -50,28 +145,30 @@ std::optional<std::string> Gameboy::loadCartridge(std::string filename) {
 
   bus->reset(cgb_flag);
   cpu.reset(cgb_flag);
+  rom = std::move(new_rom);
+  state_size = 0;
 
   return {};
 }
 
 std::variant<std::unique_ptr<Mbc>, std::string> Gameboy::makeMbc(
     std::string_view filename, uint8_t type, size_t ram_size,
-    const std::vector<uint8_t> &data) {
+    std::shared_ptr<const RomImage> rom) {
   switch (type) {
     case 0x00:
-      return std::make_unique<Mbc0>(data, ram_size);
+      return std::make_unique<Mbc0>(std::move(rom), ram_size);
       break;
     case 0x01:
     case 0x02:
     case 0x03:
-      return std::make_unique<Mbc1>(filename, type, data, ram_size);
+      return std::make_unique<Mbc1>(filename, type, std::move(rom), ram_size);
       break;
     case 0x0F:
     case 0x10:
     case 0x11:
     case 0x12:
     case 0x13:
-      return std::make_unique<Mbc3>(filename, type, data, ram_size);
+      return std::make_unique<Mbc3>(filename, type, std::move(rom), ram_size);
       break;
     case 0x19:
     case 0x1A:
@@ -79,7 +176,7 @@ std::variant<std::unique_ptr<Mbc>, std::string> Gameboy::makeMbc(
     case 0x1C:
     case 0x1D:
     case 0x1E:
-      return std::make_unique<Mbc5>(filename, type, data, ram_size);
+      return std::make_unique<Mbc5>(filename, type, std::move(rom), ram_size);
       break;
     case 0x05:
     case 0x06:
@@ -0,0 +1,118 @@
+#include "hash.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+namespace {
+
+const uint64_t kPrime1 = 0x9E3779B185EBCA87;
+const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4F;
+const uint64_t kPrime3 = 0x165667B19E3779F9;
+const uint64_t kPrime4 = 0x85EBCA77C2B2AE63;
+const uint64_t kPrime5 = 0x27D4EB2F165667C5;
+
+uint64_t read64(const uint8_t *p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  if constexpr (std::endian::native == std::endian::big) {
+    value = __builtin_bswap64(value);
+  }
+  return value;
+}
+
+uint32_t read32(const uint8_t *p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  if constexpr (std::endian::native == std::endian::big) {
+    value = __builtin_bswap32(value);
+  }
+  return value;
+}
+
+uint64_t round(uint64_t lane, uint64_t input) {
+  lane += input * kPrime2;
+  lane = std::rotl(lane, 31);
+  return lane * kPrime1;
+}
+
+uint64_t mergeRound(uint64_t acc, uint64_t lane) {
+  acc ^= round(0, lane);
+  return acc * kPrime1 + kPrime4;
+}
+
+}  // namespace
+
+Hasher::Hasher(uint64_t seed_)
+    : seed(seed_),
+      lanes{seed_ + kPrime1 + kPrime2, seed_ + kPrime2, seed_,
+            seed_ - kPrime1},
+      buffer(),
+      buffered(0),
+      total_size(0) {}
+
+void Hasher::update(const void *data, size_t size) {
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  total_size += size;
+
+  // Top up a partial stripe first
+  if (buffered > 0) {
+    size_t n = std::min(size, buffer.size() - buffered);
+    std::memcpy(buffer.data() + buffered, p, n);
+    buffered += n;
+    p += n;
+    size -= n;
+    if (buffered < buffer.size()) return;
+
+    for (size_t i = 0; i < 4; i++) {
+      lanes[i] = round(lanes[i], read64(buffer.data() + 8 * i));
+    }
+    buffered = 0;
+  }
+
+  for (; size >= 32; p += 32, size -= 32) {
+    lanes[0] = round(lanes[0], read64(p));
+    lanes[1] = round(lanes[1], read64(p + 8));
+    lanes[2] = round(lanes[2], read64(p + 16));
+    lanes[3] = round(lanes[3], read64(p + 24));
+  }
+
+  std::memcpy(buffer.data(), p, size);
+  buffered = size;
+}
+
+uint64_t Hasher::digest() const {
+  uint64_t h;
+  if (total_size >= 32) {
+    h = std::rotl(lanes[0], 1) + std::rotl(lanes[1], 7) +
+        std::rotl(lanes[2], 12) + std::rotl(lanes[3], 18);
+    for (uint64_t lane : lanes) h = mergeRound(h, lane);
+  } else {
+    h = seed + kPrime5;
+  }
+  h += total_size;
+
+  const uint8_t *p = buffer.data();
+  size_t size = buffered;
+  for (; size >= 8; p += 8, size -= 8) {
+    h ^= round(0, read64(p));
+    h = std::rotl(h, 27) * kPrime1 + kPrime4;
+  }
+  if (size >= 4) {
+    h ^= read32(p) * kPrime1;
+    h = std::rotl(h, 23) * kPrime2 + kPrime3;
+    p += 4;
+    size -= 4;
+  }
+  for (; size > 0; p++, size--) {
+    h ^= *p * kPrime5;
+    h = std::rotl(h, 11) * kPrime1;
+  }
+
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h;
+}
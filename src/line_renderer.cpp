@@ -0,0 +1,219 @@
+#include "line_renderer.h"
+
+#include <algorithm>
+
+void LineRenderer::drawLine(const LineState &state, Line &line) const {
+  if (state.lcd_y >= 144) throw "Attempted to draw at invalid line";
+
+  LinePriority priority{};
+  drawBgLine(state, line, priority);
+  drawWinLine(state, line, priority);
+  drawObjLine(state, line, priority);
+}
+
+void LineRenderer::drawBgLine(const LineState &state, Line &line,
+                              LinePriority &priority) const {
+  bool bg_win_enable = state.cgb_mode || (state.control & 1);
+  if (!bg_win_enable) return;
+
+  uint16_t tile_map_base = ((state.control >> 3) & 1) ? 0x9C00 : 0x9800;
+  uint16_t tile_row_index = (((state.lcd_y + state.scroll_y) / 8) % 32) * 32;
+  uint16_t line_index = (state.lcd_y + state.scroll_y) % 8;
+  for (uint16_t tile_col = 0; tile_col < 21; tile_col++) {
+    uint16_t tile_col_index = (tile_col + (state.scroll_x / 8)) % 32;
+    size_t left_x = tile_col * 8 - (state.scroll_x % 8);
+    drawTileRow(state, tile_map_base + tile_row_index + tile_col_index,
+                line_index, left_x, line, priority);
+  }
+}
+
+void LineRenderer::drawWinLine(const LineState &state, Line &line,
+                               LinePriority &priority) const {
+  if (!state.window_visible) return;
+
+  uint16_t tile_map_base = ((state.control >> 6) & 1) ? 0x9C00 : 0x9800;
+  uint16_t tile_row_index = (state.window_line / 8) * 32;
+  uint16_t line_index = state.window_line % 8;
+  for (uint16_t tile_col = 0; tile_col < 21; tile_col++) {
+    size_t left_x = tile_col * 8 + (state.window_x - 7);
+    drawTileRow(state, tile_map_base + tile_row_index + tile_col, line_index,
+                left_x, line, priority);
+  }
+}
+
+void LineRenderer::drawTileRow(const LineState &state, uint16_t tile_map_addr,
+                               uint16_t line_index, size_t left_x, Line &line,
+                               LinePriority &priority) const {
+  bool signed_addressing = ((state.control >> 4) & 1) == 0;
+  uint16_t tile_data_base = signed_addressing ? 0x9000 : 0x8000;
+
+  uint8_t tile_index = readVramBank0(tile_map_addr);
+
+  uint8_t attrs = 0;
+  if (state.cgb_mode) attrs = readVramBank1(tile_map_addr);
+  bool y_flip = (attrs >> 6) & 1;
+  bool x_flip = (attrs >> 5) & 1;
+  uint8_t tile_priority = (attrs >> 7) ? kBgPriority : 0;
+
+  uint16_t tile_start = static_cast<uint16_t>(
+      tile_data_base +
+      (signed_addressing ? static_cast<int8_t>(tile_index) : tile_index) * 16);
+  if ((attrs >> 3) & 1) tile_start += 0x2000;
+
+  size_t line_n = y_flip ? 7 - line_index : line_index;
+  uint8_t least_sig_bits =
+      readVramBank0(static_cast<uint16_t>(tile_start + line_n * 2));
+  uint8_t most_sig_bits =
+      readVramBank0(static_cast<uint16_t>(tile_start + line_n * 2 + 1));
+
+  for (size_t pixel = 0; pixel < 8; pixel++) {
+    size_t pixel_num = x_flip ? pixel : 7 - pixel;
+    size_t pixel_index_x = left_x + pixel;
+    if (pixel_index_x >= 160) continue;
+
+    uint8_t palette_i =
+        static_cast<uint8_t>(((most_sig_bits >> pixel_num) & 1) << 1) |
+        static_cast<uint8_t>((least_sig_bits >> pixel_num) & 1);
+    uint16_t color;
+    if (state.cgb_mode) {
+      uint8_t palette_num = attrs & 0b111;
+      uint8_t color_i = palette_num * 8 + palette_i * 2;
+      color = static_cast<uint16_t>((state.cgb_bg_palette[color_i + 1]) << 8) |
+              state.cgb_bg_palette[color_i];
+    } else {
+      uint8_t color_i = (state.dmg_bg_palette >> (palette_i * 2)) & 0b11;
+      color = dmg_colors[color_i];
+    }
+    line[pixel_index_x] = color;
+    priority[pixel_index_x] = palette_i == 0 ? 0 : (kBgOpaque | tile_priority);
+  }
+}
+
+void LineRenderer::drawObjLine(const LineState &state, Line &line,
+                               const LinePriority &priority) const {
+  bool obj_enable = (state.control >> 1) & 1;
+  if (!obj_enable) return;
+
+  const bool large_obj = (state.control >> 2) & 1;
+  const LineSprites &sprites = sprite_lists[large_obj][state.lcd_y];
+
+  // In Non-CGB mode, the smaller the X coordinate, the higher the priority.
+  // When X coordinates are identical, the object located first in OAM has
+  // higher priority.
+  // In CGB mode, only the object’s location in OAM determines its priority. The
+  // earlier the object, the higher its priority.
+  const auto &priority_order =
+      state.cgb_mode ? sprites.oam_order : sprites.x_order;
+
+  // In CGB mode, clearing LCDC bit 0 puts objects above the BG regardless of
+  // any priority bits
+  const bool bg_can_hide_obj = !state.cgb_mode || (state.control & 1);
+
+  // Only the highest-priority opaque object pixel counts, even if the BG then
+  // hides it, so lower-priority objects never show through
+  std::array<bool, 160> obj_drawn{};
+
+  for (size_t i = 0; i < sprites.count; i++) {
+    const uint8_t *entry = &oam[priority_order[i] * 4];
+    const uint8_t y = entry[0], x = entry[1], attrs = entry[3];
+
+    if (x == 0 || x >= 168) continue;
+
+    bool y_flip = (attrs >> 6) & 1;
+    bool x_flip = (attrs >> 5) & 1;
+    uint8_t palette_num = state.cgb_mode ? (attrs & 0b111) : ((attrs >> 4) & 1);
+
+    // An object pixel is hidden if the BG pixel under it has any of these bits
+    uint8_t hidden_by = 0;
+    if (bg_can_hide_obj) {
+      hidden_by = kBgPriority | (((attrs >> 7) & 1) ? kBgOpaque : 0);
+    }
+
+    int16_t x_signed = static_cast<int16_t>(x) - 8;
+    int16_t y_signed = static_cast<int16_t>(y) - 16;
+    uint8_t line_index =
+        static_cast<uint8_t>(static_cast<int16_t>(state.lcd_y) - y_signed);
+    uint8_t tile_to_draw = entry[2];
+    if (large_obj) {
+      tile_to_draw &= ~1;
+      if (line_index >= 8) {
+        tile_to_draw |= 1;
+        line_index -= 8;
+      }
+
+      if (y_flip) tile_to_draw ^= 1;
+    }
+
+    uint16_t tile_start = 0x8000 + tile_to_draw * 16;
+    if (state.cgb_mode && ((attrs >> 3) & 1)) tile_start += 0x2000;
+
+    size_t line_n = y_flip ? 7 - line_index : line_index;
+    uint8_t least_sig_bits =
+        readVramBank0(static_cast<uint16_t>(tile_start + line_n * 2));
+    uint8_t most_sig_bits =
+        readVramBank0(static_cast<uint16_t>(tile_start + line_n * 2 + 1));
+
+    for (size_t pixel = 0; pixel < 8; pixel++) {
+      size_t pixel_index_x =
+          static_cast<size_t>(x_signed + static_cast<int>(pixel));
+      if (pixel_index_x >= 160) continue;
+
+      size_t pixel_num = x_flip ? pixel : 7 - pixel;
+      uint8_t palette_i =
+          static_cast<uint8_t>(((most_sig_bits >> pixel_num) & 1) << 1) |
+          static_cast<uint8_t>((least_sig_bits >> pixel_num) & 1);
+      if (palette_i == 0 || obj_drawn[pixel_index_x]) continue;
+      obj_drawn[pixel_index_x] = true;
+
+      if (priority[pixel_index_x] & hidden_by) continue;
+
+      uint16_t color;
+      if (state.cgb_mode) {
+        uint8_t color_i = palette_num * 8 + palette_i * 2;
+        color =
+            static_cast<uint16_t>((state.cgb_obj_palette[color_i + 1]) << 8) |
+            state.cgb_obj_palette[color_i];
+      } else {
+        uint8_t color_i =
+            (state.dmg_obj_palette[palette_num] >> (palette_i * 2)) & 0b11;
+        color = dmg_colors[color_i];
+      }
+      line[pixel_index_x] = color;
+    }
+  }
+}
+
+void LineRenderer::updateSprites() {
+  if (!sprites_dirty) return;
+  sprites_dirty = false;
+
+  for (size_t large_obj = 0; large_obj < 2; large_obj++) {
+    auto &lists = sprite_lists[large_obj];
+    for (auto &sprites : lists) sprites.count = 0;
+
+    // Each line selects the first 10 objects in OAM that overlap it
+    const int height = large_obj ? 16 : 8;
+    for (uint8_t oam_index = 0; oam_index < 40; oam_index++) {
+      const int top = oam[size_t{oam_index} * 4] - 16;
+      const int first_line = std::max(top, 0);
+      const int end_line = std::min(top + height, 144);
+      for (int y = first_line; y < end_line; y++) {
+        LineSprites &sprites = lists[static_cast<size_t>(y)];
+        if (sprites.count < 10) sprites.oam_order[sprites.count++] = oam_index;
+      }
+    }
+
+    // A stable insertion sort by X gives the DMG priority order
+    for (auto &sprites : lists) {
+      for (size_t i = 0; i < sprites.count; i++) {
+        const uint8_t oam_index = sprites.oam_order[i];
+        const uint8_t x = oam[size_t{oam_index} * 4 + 1];
+        size_t j = i;
+        for (; j > 0 && oam[size_t{sprites.x_order[j - 1]} * 4 + 1] > x; j--) {
+          sprites.x_order[j] = sprites.x_order[j - 1];
+        }
+        sprites.x_order[j] = oam_index;
+      }
+    }
+  }
+}
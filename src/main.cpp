@@ -1,28 +1,680 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "SDL.h"
+#include "audio_ring_buffer.h"
 #include "gameboy.h"
+#include "movie.h"
+#include "post_processor.h"
+#include "recorder.h"
+#include "rewind_buffer.h"
+#include "snapshot_cache.h"
+#include "state_archive.h"
+
+// One frame is 70224 dots at 4194304 dots per second (~59.73 FPS)
+const auto kFrameDuration = std::chrono::nanoseconds(16742706);
+
+// How much audio to keep queued for the device, in seconds
+const double kAudioLatency = 0.05;
+
+// How many archived states there are to each keyframe
+const int kArchiveKeyframeInterval = 30;
+
+// Asked for by the presentation thread, and carried out between frames
+enum class StateRequest { kNone, kSave, kLoad };
+
+// Input handed from the presentation thread to the emulation thread. Button
+// state is (action << 4) | dir.
+struct Controls {
+  std::atomic<bool> quit = false;
+  std::atomic<bool> fast_forward = false;
+  std::atomic<bool> rewinding = false;
+  std::atomic<uint8_t> buttons = 0xFF;
+  std::atomic<StateRequest> state_request = StateRequest::kNone;
+};
+
+// What emulate does besides running frames
+struct Features {
+  std::string state_filename;  // For F5 and F8
+  RewindBuffer *rewind = nullptr;
+  int rewind_interval = 1;
+  int run_ahead = 0;
+  MovieWriter *movie = nullptr;
+  StateArchiveWriter *archive = nullptr;
+  int archive_interval = 60;
+};
+
+struct AudioOutput {
+  AudioRingBuffer<8192> ring;
+  size_t target = 0;  // Frames to keep queued
+};
+
+// Runs on SDL's audio thread, so it mustn't block
+void audioCallback(void *userdata, Uint8 *stream, int len) {
+  auto *audio = static_cast<AudioOutput *>(userdata);
+  auto *out = reinterpret_cast<int16_t *>(stream);
+  const size_t frames = static_cast<size_t>(len) / (2 * sizeof(int16_t));
+  const size_t n = audio->ring.read(out, frames);
+
+  // Play silence on an underrun
+  std::fill(out + 2 * n, out + 2 * frames, 0);
+}
+
+// Hands a frame's worth of audio to the device, waiting until the queue has
+// drained to its target first. This is what paces emulation when there's
+// audio, as the device's clock is the one that has to be kept fed. Being
+// paced by that clock, emulation can't drift from it, so the sample rate
+// is left as the device's.
+void queueAudio(Gameboy &gameboy, AudioOutput &audio,
+                const std::atomic<bool> &quit, bool fast_forward) {
+  while (!fast_forward && audio.ring.size() > audio.target) {
+    if (quit.load(std::memory_order_relaxed)) return;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  // Fast-forwarded audio is dropped rather than queued
+  std::array<int16_t, 2 * 1024> samples;
+  size_t n;
+  while ((n = gameboy.readAudio(samples.data(), samples.size() / 2)) > 0) {
+    if (!fast_forward) audio.ring.write(samples.data(), n);
+  }
+}
+
+// Runs until the next frame, returning false if quit was set first. Quit is
+// checked periodically in case the LCD is off and no frame comes.
+bool runFrame(Gameboy &gameboy, const std::atomic<bool> &quit) {
+  size_t n_steps = 0;
+  while (!gameboy.step()) {
+    n_steps++;
+    if (n_steps % 10000 == 0 && quit.load(std::memory_order_relaxed)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs the emulator on its own thread, paced to real time unless
+// fast_forward is set. With audio, the pace is set by the audio device,
+// and otherwise by the clock.
+//
+// With a rewind buffer, a state is captured every rewind_interval frames.
+// While rewinding, each frame instead goes back to the last state captured,
+// and runs one frame from there to show it.
+//
+// With a movie, every input is recorded, as is every state loaded other
+// than run-ahead's, which only puts back the state from before it.
+//
+// With an archive, the state every archive_interval frames is archived,
+// with the buttons held for each frame since the last one. Frames are
+// numbered from the start of the session.
+//
+// With run-ahead, each frame is run without being drawn, and its state
+// saved. The next run_ahead frames are then run with the same input,
+// silently and drawing only the last, which is what's shown, and the saved
+// state is restored. The game's reaction to input is seen run_ahead frames
+// sooner, for the cost of emulating that many extra frames.
+void emulate(Gameboy &gameboy, AudioOutput *audio, Controls &controls,
+             const Features &features) {
+  const std::atomic<bool> &quit = controls.quit;
+  std::vector<uint8_t> rewind_state;
+  int frames_until_capture = 0;
+  std::vector<uint8_t> run_ahead_state;
+  std::chrono::steady_clock::duration run_ahead_time{};
+  int run_ahead_frames = 0;
+  uint64_t frame = 0;
+  std::vector<uint8_t> archive_input;
+  auto next_frame = std::chrono::steady_clock::now();
+  while (!quit.load(std::memory_order_relaxed)) {
+    const uint64_t frame_start = gameboy.getElapsedDots();
+    bool loaded = false;
+    std::optional<std::string> state_error;
+    switch (controls.state_request.exchange(StateRequest::kNone)) {
+      case StateRequest::kNone:
+        break;
+      case StateRequest::kSave:
+        state_error = gameboy.saveStateFile(features.state_filename);
+        break;
+      case StateRequest::kLoad:
+        state_error = gameboy.loadStateFile(features.state_filename);
+        loaded = !state_error;
+        break;
+    }
+    if (state_error) std::cerr << *state_error << std::endl;
+
+    RewindBuffer *rewind = features.rewind;
+    if (rewind && controls.rewinding.load(std::memory_order_relaxed)) {
+      if (rewind->pop(rewind_state)) {
+        loaded = !gameboy.loadState(rewind_state.data(), rewind_state.size());
+      }
+      frames_until_capture = 0;
+    } else if (rewind && --frames_until_capture <= 0) {
+      gameboy.saveState(rewind_state);
+      rewind->push(rewind_state);
+      frames_until_capture = features.rewind_interval;
+    }
+
+    uint8_t keys = controls.buttons.load(std::memory_order_relaxed);
+    if (loaded && features.movie) {
+      features.movie->recordLoad(gameboy, frame_start);
+    }
+    gameboy.setButtonsPressed(keys >> 4, keys & 0xF);
+    if (features.movie) features.movie->recordInput(gameboy, keys);
+
+    if (features.run_ahead > 0) gameboy.setRenderingEnabled(false);
+    if (!runFrame(gameboy, quit)) return;
+    frame++;
+
+    if (features.archive) {
+      archive_input.push_back(keys);
+      if (archive_input.size() >=
+          static_cast<size_t>(features.archive_interval)) {
+        // A dropped entry's input goes with the next one instead
+        if (features.archive->append(gameboy, frame, archive_input.data(),
+                                     archive_input.size())) {
+          archive_input.clear();
+        }
+      }
+    }
+
+    if (features.run_ahead > 0) {
+      const auto start = std::chrono::steady_clock::now();
+      gameboy.saveState(run_ahead_state);
+      gameboy.setAudioEnabled(false);
+      for (int i = 1; i <= features.run_ahead; i++) {
+        gameboy.setRenderingEnabled(i == features.run_ahead);
+        if (!runFrame(gameboy, quit)) return;
+      }
+      gameboy.loadState(run_ahead_state.data(), run_ahead_state.size());
+      if (audio) gameboy.setAudioEnabled(true);
+
+      // Report the cost every ten seconds or so, to help choose run_ahead
+      run_ahead_time += std::chrono::steady_clock::now() - start;
+      if (++run_ahead_frames == 600) {
+        const double ms =
+            std::chrono::duration<double, std::milli>(run_ahead_time)
+                .count() /
+            run_ahead_frames;
+        const double budget =
+            std::chrono::duration<double, std::milli>(kFrameDuration).count();
+        std::cerr << "Run-ahead of " << features.run_ahead
+                  << " frames: " << ms << " ms per frame ("
+                  << 100 * ms / budget << "% of real time)" << std::endl;
+        run_ahead_time = {};
+        run_ahead_frames = 0;
+      }
+    }
+
+    const bool fast_forward =
+        controls.fast_forward.load(std::memory_order_relaxed);
+    if (audio) {
+      queueAudio(gameboy, *audio, quit, fast_forward);
+    } else if (fast_forward) {
+      next_frame = std::chrono::steady_clock::now();
+    } else {
+      next_frame += kFrameDuration;
+      std::this_thread::sleep_until(next_frame);
+    }
+  }
+}
+
+// Runs without a window for the given emulated time, as fast as possible,
+// writing whichever of video, audio and frame deltas were asked for. Returns
+// the exit code.
+int record(Gameboy &gameboy, PostProcessor &post_processor, int frame_skip,
+           const std::string &video_filename,
+           const std::string &audio_filename,
+           const std::string &deltas_filename, double seconds) {
+  const uint64_t dots_per_video_frame =
+      static_cast<uint64_t>(kDotsPerFrame * (frame_skip + 1));
+
+  Recorder recorder;
+  if (!video_filename.empty()) {
+    auto error_msg = recorder.openVideo(
+        video_filename, post_processor.getWidth(), post_processor.getHeight(),
+        static_cast<uint64_t>(kApuClockRate), dots_per_video_frame);
+    if (error_msg) {
+      std::cerr << *error_msg << std::endl;
+      return 1;
+    }
+  }
+  if (!audio_filename.empty()) {
+    auto error_msg = recorder.openAudio(audio_filename,
+                                        static_cast<int>(kDefaultSampleRate));
+    if (error_msg) {
+      std::cerr << *error_msg << std::endl;
+      return 1;
+    }
+    gameboy.setAudioSampleRate(kDefaultSampleRate);
+    gameboy.setAudioEnabled(true);
+  }
+  if (!deltas_filename.empty()) {
+    auto error_msg = recorder.openFrameDeltas(deltas_filename);
+    if (error_msg) {
+      std::cerr << *error_msg << std::endl;
+      return 1;
+    }
+  }
+
+  const uint64_t start = gameboy.getElapsedDots();
+  const uint64_t end =
+      start + static_cast<uint64_t>(seconds * kApuClockRate);
+  uint64_t frames_written = 0;
+  uint64_t last_frame = 0;
+  std::array<int16_t, 2 * 1024> samples;
+  size_t n_steps = 0;
+  while (gameboy.getElapsedDots() < end) {
+    // Also check in periodically in case the LCD is off and no frame comes
+    n_steps++;
+    if (!gameboy.step() && n_steps % 10000 != 0) continue;
+
+    if (recorder.hasAudio()) {
+      size_t n;
+      while ((n = gameboy.readAudio(samples.data(), samples.size() / 2)) > 0) {
+        recorder.writeAudio(samples.data(), n);
+      }
+    }
+
+    if (recorder.hasVideo() || recorder.hasFrameDeltas()) {
+      gameboy.finishRendering();
+      auto &frame = gameboy.getFrame();
+      if (frame.number != last_frame) {
+        if (recorder.hasVideo()) {
+          post_processor.process(frame.pixels, recorder.beginFrame(),
+                                 post_processor.getWidth());
+          recorder.submitFrame();
+          frames_written++;
+        }
+        if (recorder.hasFrameDeltas()) recorder.writeFrameDelta(frame);
+        last_frame = frame.number;
+      }
+
+      // Skipped or blank frames still take time, so keep the video in step
+      // with the audio by showing the last frame for longer
+      const uint64_t due =
+          (gameboy.getElapsedDots() - start) / dots_per_video_frame;
+      while (frames_written > 0 && frames_written < due) {
+        recorder.repeatFrame();
+        frames_written++;
+      }
+    }
+  }
+
+  auto error_msg = recorder.close();
+  if (error_msg) {
+    std::cerr << *error_msg << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Replays the rest of a movie without a window, as fast as possible,
+// checking that it stays in step. Returns the exit code.
+int replay(Gameboy &gameboy, MoviePlayer &player) {
+  gameboy.setRenderingEnabled(false);
+  const auto start = std::chrono::steady_clock::now();
+  auto error_msg = player.play(gameboy);
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+
+  std::cerr << "Replayed " << player.getFrames() << " frames in " << seconds
+            << " s (" << static_cast<double>(player.getFrames()) / seconds
+            << " FPS), checking " << player.getHashesChecked()
+            << " state hashes" << std::endl;
+  if (error_msg) {
+    std::cerr << *error_msg << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Loads the state archived for the given frame, or the last one
+std::optional<std::string> loadFromArchive(Gameboy &gameboy,
+                                           const std::string &filename,
+                                           std::optional<uint64_t> frame) {
+  auto reader_result = StateArchiveReader::open(filename);
+  if (std::holds_alternative<std::string>(reader_result)) {
+    return std::get<std::string>(reader_result);
+  }
+  const StateArchiveReader &reader = *std::get<0>(reader_result);
+
+  std::optional<size_t> n;
+  if (frame) {
+    n = reader.find(*frame);
+  } else if (reader.size() > 0) {
+    n = reader.size() - 1;
+  }
+  if (!n) return "No archived state for that frame: " + filename;
+
+  std::vector<uint8_t> state;
+  if (!reader.readState(*n, state)) return "Archive is corrupt: " + filename;
+  return gameboy.loadState(state.data(), state.size());
+}
+
+// Runs the first frames of a session without showing them, as fast as
+// possible, taking input from the movie if there is one. With a cache, the
+// state after them is loaded if they've been run the same way before, and
+// stored for next time otherwise.
+std::optional<std::string> skipFrames(Gameboy &gameboy, MoviePlayer *player,
+                                      uint64_t frames, SnapshotCache *cache,
+                                      uint64_t key) {
+  const auto start = std::chrono::steady_clock::now();
+  const auto elapsed_ms = [&start] {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  std::vector<uint8_t> extra;
+  if (cache && cache->load(key, gameboy, extra)) {
+    StateReader reader(extra.data(), extra.size());
+    if (!player || player->loadPosition(reader)) {
+      std::cerr << "Loaded a snapshot after " << frames << " frames in "
+                << elapsed_ms() << " ms" << std::endl;
+      return {};
+    }
+    // The snapshot doesn't fit the movie, so start it again
+    auto error_msg = player->start(gameboy);
+    if (error_msg) return error_msg;
+  }
+
+  gameboy.setRenderingEnabled(false);
+  if (player) {
+    auto error_msg = player->play(gameboy, frames);
+    if (error_msg) return error_msg;
+  } else {
+    for (uint64_t i = 0; i < frames; i++) {
+      while (!gameboy.step()) {
+      }
+    }
+  }
+  gameboy.setRenderingEnabled(true);
+  std::cerr << "Skipped " << frames << " frames in " << elapsed_ms() << " ms"
+            << std::endl;
+
+  if (cache) {
+    StateWriter writer(extra);
+    if (player) player->savePosition(writer);
+    return cache->store(key, gameboy, extra);
+  }
+  return {};
+}
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " <GB ROM file>" << std::endl;
+  const std::unordered_map<std::string_view, RenderMode> render_modes = {
+      {"immediate", RenderMode::kImmediate},
+      {"thread", RenderMode::kWorker},
+      {"deferred", RenderMode::kDeferred},
+      {"deferred-checked", RenderMode::kDeferredChecked}};
+  const std::unordered_map<std::string_view, ScaleFilter> filters = {
+      {"nearest", ScaleFilter::kNearest}, {"scale2x", ScaleFilter::kScale2x},
+      {"scale3x", ScaleFilter::kScale3x}, {"scale4x", ScaleFilter::kScale4x},
+      {"xbr2x", ScaleFilter::kXbr2x},     {"xbr4x", ScaleFilter::kXbr4x}};
+
+  std::optional<std::string> rom_filename;
+  RenderMode render_mode = RenderMode::kImmediate;
+  int frame_skip = 0;
+  ScaleFilter filter = ScaleFilter::kNearest;
+  int scale = 0;
+  bool color_correction = false;
+  bool frame_blending = false;
+  bool audio_enabled = true;
+  std::string record_video;
+  std::string record_audio;
+  std::string record_deltas;
+  double record_seconds = 0;
+  int rewind_megabytes = 64;
+  int rewind_interval = 1;
+  int run_ahead = 0;
+  std::string record_movie;
+  std::string play_movie;
+  std::string load_state;
+  std::string load_archive;
+  std::optional<uint64_t> archive_frame;
+  std::string archive;
+  int archive_interval = 60;
+  int skip_frames = 0;
+  std::string snapshot_cache;
+  RtcMode rtc_mode = RtcMode::kEmulated;
+  bool bad_args = false;
+  for (int i = 1; i < argc; i++) {
+    const std::string_view arg = argv[i];
+    if (arg.starts_with("--render=")) {
+      auto it = render_modes.find(arg.substr(arg.find('=') + 1));
+      if (it == render_modes.end()) {
+        bad_args = true;
+      } else {
+        render_mode = it->second;
+      }
+    } else if (arg.starts_with("--frame-skip=")) {
+      frame_skip = std::atoi(argv[i] + arg.find('=') + 1);
+    } else if (arg.starts_with("--filter=")) {
+      auto it = filters.find(arg.substr(arg.find('=') + 1));
+      if (it == filters.end()) {
+        bad_args = true;
+      } else {
+        filter = it->second;
+      }
+    } else if (arg.starts_with("--scale=")) {
+      scale = std::atoi(argv[i] + arg.find('=') + 1);
+    } else if (arg == "--color-correction") {
+      color_correction = true;
+    } else if (arg == "--frame-blend") {
+      frame_blending = true;
+    } else if (arg == "--no-audio") {
+      audio_enabled = false;
+    } else if (arg.starts_with("--record-video=")) {
+      record_video = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--record-audio=")) {
+      record_audio = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--record-frame-deltas=")) {
+      record_deltas = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--record-seconds=")) {
+      record_seconds = std::atof(argv[i] + arg.find('=') + 1);
+    } else if (arg.starts_with("--rewind-memory=")) {
+      rewind_megabytes = std::atoi(argv[i] + arg.find('=') + 1);
+    } else if (arg.starts_with("--rewind-interval=")) {
+      rewind_interval = std::atoi(argv[i] + arg.find('=') + 1);
+      if (rewind_interval < 1) bad_args = true;
+    } else if (arg.starts_with("--run-ahead=")) {
+      run_ahead = std::atoi(argv[i] + arg.find('=') + 1);
+      if (run_ahead < 0) bad_args = true;
+    } else if (arg.starts_with("--load-state=")) {
+      load_state = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--load-archive=")) {
+      load_archive = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--archive-frame=")) {
+      archive_frame = std::strtoull(argv[i] + arg.find('=') + 1, nullptr, 10);
+    } else if (arg.starts_with("--archive=")) {
+      archive = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--archive-interval=")) {
+      archive_interval = std::atoi(argv[i] + arg.find('=') + 1);
+      if (archive_interval < 1) bad_args = true;
+    } else if (arg.starts_with("--skip-frames=")) {
+      skip_frames = std::atoi(argv[i] + arg.find('=') + 1);
+      if (skip_frames < 0) bad_args = true;
+    } else if (arg.starts_with("--snapshot-cache=")) {
+      snapshot_cache = arg.substr(arg.find('=') + 1);
+    } else if (arg == "--rtc=emulated") {
+      rtc_mode = RtcMode::kEmulated;
+    } else if (arg == "--rtc=wall") {
+      rtc_mode = RtcMode::kWallClock;
+    } else if (arg.starts_with("--record-movie=")) {
+      record_movie = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--play-movie=")) {
+      play_movie = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--")) {
+      bad_args = true;
+    } else {
+      rom_filename = arg;
+    }
+  }
+
+  const bool recording = !record_video.empty() || !record_audio.empty() ||
+                         !record_deltas.empty();
+  if (recording && record_seconds <= 0) bad_args = true;
+  const int starts = !load_state.empty() + !load_archive.empty() +
+                     !play_movie.empty();
+  if (starts > 1) bad_args = true;
+
+  if (!rom_filename || bad_args) {
+    std::cerr << "Usage: " << argv[0] << " [options] <GB ROM file>\n"
+              << "  --render=immediate|thread|deferred|deferred-checked\n"
+              << "  --frame-skip=N  Only draw one of every N + 1 frames\n"
+              << "  --filter=nearest|scale2x|scale3x|scale4x|xbr2x|xbr4x\n"
+              << "  --scale=N  Scale for the nearest filter (default 4, or 1 "
+                 "when recording)\n"
+              << "  --color-correction  Show colors like the CGB LCD\n"
+              << "  --frame-blend  Blend each frame with the previous one\n"
+              << "  --no-audio  Don't play sound\n"
+              << "  --rewind-memory=MB  Memory for rewinding, or 0 for none "
+                 "(default 64)\n"
+              << "  --rewind-interval=N  Keep the state of every Nth frame "
+                 "for rewinding (default 1)\n"
+              << "  --run-ahead=N  Show the game N frames ahead, to hide "
+                 "its input lag\n"
+              << "  --rtc=emulated|wall  Run the cartridge clock on emulated "
+                 "time (the default) or the host's\n"
+              << "  --record-movie=FILE  Record the session's input, to "
+                 "replay exactly\n"
+              << "  --play-movie=FILE  Replay a movie without a window, as "
+                 "fast as possible, checking it stays in step\n"
+              << "  --load-state=FILE  Start from a save state rather than "
+                 "power on\n"
+              << "  --load-archive=FILE  Start from a state in an archive\n"
+              << "  --archive-frame=N  Which frame's state to load from the "
+                 "archive (default the last)\n"
+              << "  --archive=FILE  Archive the state every so often, with "
+                 "the input between\n"
+              << "  --archive-interval=N  Frames between archived states "
+                 "(default 60)\n"
+              << "  --skip-frames=N  Run the first N frames (of the movie, "
+                 "if playing one) without showing them\n"
+              << "  --snapshot-cache=DIR  Keep the state after the skipped "
+                 "frames in DIR, and load it next time\n"
+              << "F5 saves the state next to the ROM, and F8 loads it.\n"
+              << "Hold Backspace to rewind.\n"
+              << "Recording runs without a window, as fast as possible:\n"
+              << "  --record-video=FILE  Write video, as Y4M if FILE ends in "
+                 ".y4m or raw RGB24 otherwise\n"
+              << "  --record-audio=FILE  Write audio as WAV\n"
+              << "  --record-frame-deltas=FILE  Write the unprocessed frames "
+                 "as a stream of changed lines\n"
+              << "  --record-seconds=N  How much emulated time to record"
+              << std::endl;
     return 1;
   }
 
   Gameboy gameboy;
 
-  std::optional<std::string> error_msg = gameboy.loadCartridge(argv[1]);
+  std::optional<std::string> error_msg = gameboy.loadCartridge(*rom_filename);
   if (error_msg) {
     std::cerr << *error_msg << std::endl;
     return 1;
   }
+  gameboy.setRenderMode(render_mode);
+  gameboy.setFrameSkip(frame_skip);
+  gameboy.setRtcMode(rtc_mode);
 
-  SDL_Init(SDL_INIT_VIDEO);
+  if (scale == 0) scale = recording ? 1 : 4;
+  PostProcessor post_processor(filter, scale);
+  post_processor.setColorCorrection(color_correction);
+  post_processor.setFrameBlending(frame_blending);
 
+  std::unique_ptr<MoviePlayer> player;
+  if (!play_movie.empty()) {
+    auto player_result = MoviePlayer::open(play_movie);
+    if (std::holds_alternative<std::string>(player_result)) {
+      std::cerr << std::get<std::string>(player_result) << std::endl;
+      return 1;
+    }
+    player = std::move(std::get<0>(player_result));
+    error_msg = player->start(gameboy);
+  } else if (!load_state.empty()) {
+    error_msg = gameboy.loadStateFile(load_state);
+  } else if (!load_archive.empty()) {
+    error_msg = loadFromArchive(gameboy, load_archive, archive_frame);
+  }
+  if (error_msg) {
+    std::cerr << *error_msg << std::endl;
+    return 1;
+  }
+
+  if (skip_frames > 0) {
+    // Everything that decides the state after the skipped frames, which for
+    // a fresh machine includes the battery save it loaded. Its RTC seed is
+    // left out, so the cache works across runs.
+    const uint64_t key = SnapshotCache::makeKey(
+        {load_state.empty() && load_archive.empty()
+             ? gameboy.getCartridgeHash()
+             : gameboy.getStateHash(),
+         player ? player->getHash() : 0, static_cast<uint64_t>(skip_frames)});
+    std::unique_ptr<SnapshotCache> cache;
+    if (!snapshot_cache.empty()) {
+      cache = std::make_unique<SnapshotCache>(snapshot_cache);
+    }
+    error_msg = skipFrames(gameboy, player.get(),
+                           static_cast<uint64_t>(skip_frames), cache.get(),
+                           key);
+    if (error_msg) {
+      std::cerr << *error_msg << std::endl;
+      return 1;
+    }
+  }
+
+  if (player) return replay(gameboy, *player);
+  if (recording) {
+    return record(gameboy, post_processor, frame_skip, record_video,
+                  record_audio, record_deltas, record_seconds);
+  }
+
+  const int width = static_cast<int>(post_processor.getWidth());
+  const int height = static_cast<int>(post_processor.getHeight());
+
+  SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+
+  // Without an audio device, emulation falls back to being paced by the clock
+  AudioOutput audio_output;
+  SDL_AudioDeviceID audio_device = 0;
+  if (audio_enabled) {
+    SDL_AudioSpec want = {};
+    want.freq = static_cast<int>(kDefaultSampleRate);
+    want.format = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples = 512;
+    want.callback = audioCallback;
+    want.userdata = &audio_output;
+    SDL_AudioSpec have;
+    audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have,
+                                       SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (audio_device == 0) {
+      std::cerr << "Couldn't open audio device: " << SDL_GetError()
+                << std::endl;
+    } else {
+      audio_output.target = std::max<size_t>(
+          2 * have.samples, static_cast<size_t>(have.freq * kAudioLatency));
+      gameboy.setAudioSampleRate(have.freq);
+      gameboy.setAudioEnabled(true);
+      SDL_PauseAudioDevice(audio_device, 0);
+    }
+  }
+
+  // The window matches the filter output, so presenting doesn't rescale
   SDL_Window *window = SDL_CreateWindow("Dodo", SDL_WINDOWPOS_UNDEFINED,
-                                        SDL_WINDOWPOS_UNDEFINED, 640, 480, 0);
+                                        SDL_WINDOWPOS_UNDEFINED, width, height,
+                                        0);
 
   SDL_Renderer *renderer =
       SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
@@ -30,25 +682,72 @@ int main(int argc, char **argv) {
   SDL_RenderClear(renderer);
   SDL_RenderPresent(renderer);
 
-  SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_BGR555,
-                                           SDL_TEXTUREACCESS_TARGET, 160, 144);
+  SDL_Texture *texture =
+      SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888,
+                        SDL_TEXTUREACCESS_STREAMING, width, height);
 
+  std::unique_ptr<RewindBuffer> rewind;
+  if (rewind_megabytes > 0) {
+    rewind = std::make_unique<RewindBuffer>(
+        static_cast<size_t>(rewind_megabytes) << 20);
+  }
+
+  Features features;
+  features.state_filename =
+      rom_filename->substr(0, rom_filename->find_last_of('.')) + ".state";
+  features.rewind = rewind.get();
+  features.rewind_interval = rewind_interval;
+  features.run_ahead = run_ahead;
+
+  std::unique_ptr<MovieWriter> movie;
+  if (!record_movie.empty()) {
+    if (rtc_mode == RtcMode::kWallClock) {
+      std::cerr << "The movie won't replay exactly with the wall-clock RTC"
+                << std::endl;
+    }
+    auto movie_result = MovieWriter::create(record_movie, gameboy);
+    if (std::holds_alternative<std::string>(movie_result)) {
+      std::cerr << std::get<std::string>(movie_result) << std::endl;
+    } else {
+      movie = std::move(std::get<0>(movie_result));
+      features.movie = movie.get();
+    }
+  }
+
+  std::unique_ptr<StateArchiveWriter> archive_writer;
+  if (!archive.empty()) {
+    auto archive_result =
+        StateArchiveWriter::create(archive, kArchiveKeyframeInterval);
+    if (std::holds_alternative<std::string>(archive_result)) {
+      std::cerr << std::get<std::string>(archive_result) << std::endl;
+    } else {
+      archive_writer = std::move(std::get<0>(archive_result));
+      features.archive = archive_writer.get();
+      features.archive_interval = archive_interval;
+    }
+  }
+
+  Controls controls;
+  std::thread emulation_thread(
+      emulate, std::ref(gameboy), audio_device ? &audio_output : nullptr,
+      std::ref(controls), std::cref(features));
+
+  // SDL wants events and rendering on the main thread, so this thread only
+  // handles input and presents whatever frame was completed most recently
   SDL_Event event;
-  while (true) {
-    Uint64 start = SDL_GetPerformanceCounter();
-
-    size_t n_steps = 0;
-    while (!gameboy.step()) {
-      n_steps++;
-      if (n_steps % 10000 == 0) {
-        SDL_PollEvent(&event);
-        if (event.type == SDL_QUIT) break;
+  uint64_t presented_frame = 0;
+  while (!controls.quit) {
+    while (SDL_PollEvent(&event)) {
+      if (event.type == SDL_QUIT) controls.quit = true;
+      if (event.type == SDL_KEYDOWN && !event.key.repeat) {
+        if (event.key.keysym.scancode == SDL_SCANCODE_F5) {
+          controls.state_request = StateRequest::kSave;
+        } else if (event.key.keysym.scancode == SDL_SCANCODE_F8) {
+          controls.state_request = StateRequest::kLoad;
+        }
       }
     }
 
-    SDL_PollEvent(&event);
-    if (event.type == SDL_QUIT) break;
-
     const Uint8 *key_state = SDL_GetKeyboardState(NULL);
     uint8_t action_keys =
         static_cast<uint8_t>(!key_state[SDL_SCANCODE_RETURN] << 3) |
@@ -60,25 +759,44 @@ int main(int argc, char **argv) {
         static_cast<uint8_t>(!key_state[SDL_SCANCODE_UP] << 2) |
         static_cast<uint8_t>(!key_state[SDL_SCANCODE_LEFT] << 1) |
         static_cast<uint8_t>(!key_state[SDL_SCANCODE_RIGHT]);
-    gameboy.setButtonsPressed(action_keys, dir_keys);
+    controls.buttons = static_cast<uint8_t>(action_keys << 4) | dir_keys;
+    controls.fast_forward = key_state[SDL_SCANCODE_TAB];
+    controls.rewinding = key_state[SDL_SCANCODE_BACKSPACE];
 
+    // Only process frames once, so a repeated frame isn't blended with itself
     auto &frame = gameboy.getFrame();
-    SDL_UpdateTexture(texture, NULL, frame.data(), 160 * 2);
+    void *pixels;
+    int pitch;
+    if (frame.number != presented_frame &&
+        SDL_LockTexture(texture, NULL, &pixels, &pitch) == 0) {
+      post_processor.process(frame.pixels, static_cast<uint32_t *>(pixels),
+                             static_cast<size_t>(pitch) / sizeof(uint32_t));
+      SDL_UnlockTexture(texture);
+      presented_frame = frame.number;
+    }
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
 
-    Uint64 end = SDL_GetPerformanceCounter();
-
-    float elapsed_ms = static_cast<float>(end - start) /
-                       static_cast<float>(SDL_GetPerformanceFrequency()) *
-                       1000.0f;
+    // Present at roughly the display rate without spinning
+    SDL_Delay(16);
+  }
 
-    // Cap to 60 FPS
-    if (elapsed_ms < 16.666f) {
-      SDL_Delay(static_cast<Uint32>(16.666f - elapsed_ms));
+  emulation_thread.join();
+  if (movie) {
+    auto movie_error = movie->finish(gameboy);
+    if (movie_error) std::cerr << *movie_error << std::endl;
+  }
+  if (archive_writer) {
+    auto archive_error = archive_writer->close();
+    if (archive_error) std::cerr << *archive_error << std::endl;
+    if (archive_writer->getDropped() > 0) {
+      std::cerr << "The archive fell behind and dropped "
+                << archive_writer->getDropped() << " states" << std::endl;
     }
   }
+  if (audio_device) SDL_CloseAudioDevice(audio_device);
 
+  SDL_DestroyTexture(texture);
   SDL_DestroyWindow(window);
   SDL_DestroyRenderer(renderer);
   SDL_Quit();
@@ -0,0 +1,71 @@
+#include "mapped_file.h"
+
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+std::variant<std::unique_ptr<MappedFile>, std::string> MappedFile::open(
+    const std::string &filename) {
+  std::unique_ptr<MappedFile> file(new MappedFile());
+  if (!file->map(filename) && !file->read(filename)) {
+    return "Failed to open file: " + filename;
+  }
+  return file;
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+  if (mapped) {
+    munmap(const_cast<uint8_t *>(bytes), length);
+  }
+#endif
+}
+
+bool MappedFile::map(const std::string &filename) {
+#ifdef _WIN32
+  (void)filename;
+  return false;
+#else
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  // Only regular, non-empty files can be mapped
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+
+  const size_t file_size = static_cast<size_t>(st.st_size);
+  void *addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the descriptor is closed
+  close(fd);
+  if (addr == MAP_FAILED) return false;
+
+  bytes = static_cast<const uint8_t *>(addr);
+  length = file_size;
+  mapped = true;
+  return true;
+#endif
+}
+
+bool MappedFile::read(const std::string &filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (file.fail()) return false;
+
+  // The size may not be known up front (e.g. for a pipe), so read in chunks
+  char chunk[1 << 16];
+  while (file.read(chunk, sizeof(chunk)) || file.gcount() > 0) {
+    buffer.insert(buffer.end(), chunk, chunk + file.gcount());
+  }
+  if (file.bad()) return false;
+
+  bytes = buffer.data();
+  length = buffer.size();
+  return true;
+}
@@ -1,20 +1,17 @@
 #include "mbc/mbc1.h"
 
 #include <algorithm>
-#include <iomanip>
-#include <iostream>
-#include <iterator>
 
 uint8_t Mbc1::readRomLo(uint16_t addr) {
   // TODO: It should behave like this on "Large ROM" cartridges:
   // size_t bank = bank_mode ? ram_bank_or_rom_bank_hi << 5 : 0;
-  // return rom[(bank * 0x4000) + addr];
-  return rom[addr];
+  // return (*rom)[(bank * 0x4000) + addr];
+  return (*rom)[addr];
 }
 
 uint8_t Mbc1::readRomHi(uint16_t addr) {
   size_t bank = static_cast<size_t>(ram_bank_or_rom_bank_hi << 5) | rom_bank_lo;
-  return rom[((bank * 0x4000) + addr) % rom.size()];
+  return (*rom)[((bank * 0x4000) + addr) % rom->size()];
 }
 
 uint8_t Mbc1::readRam(uint16_t addr) {
@@ -43,36 +40,57 @@ void Mbc1::writeRomHi(uint16_t addr, uint8_t data) {
 void Mbc1::writeRam(uint16_t addr, uint8_t data) {
   if (!ram_enabled) return;
   size_t bank = bank_mode ? ram_bank_or_rom_bank_hi : 0;
-  ram[((bank * 0x2000) + addr) % ram.size()] = data;
+  size_t index = ((bank * 0x2000) + addr) % ram.size();
+  ram.write(index, data);
+  if (save) save->markDirty(index);
 }
 
 void Mbc1::restoreSaveFile() {
-  if (!savefile_opt) return;
-
-  std::ifstream file_in;
-  file_in.open(*savefile_opt, std::fstream::in | std::fstream::binary);
-
-  if (file_in) {
-    file_in.seekg(0, std::ios::end);
-    std::streampos filesize = file_in.tellg();
-    file_in.seekg(0);
-
-    std::copy_n(std::istreambuf_iterator<char>(file_in),
-                std::min(static_cast<size_t>(filesize), ram.capacity()),
-                std::back_inserter(ram));
-  }
+  const std::vector<uint8_t> data = save->load();
+  ram.copyIn(data.data(), data.size());
+}
 
-  ram.resize(ram.capacity(), 0);
+void Mbc1::writeSaveFile(bool force) {
+  if (save) save->flush(ram, {}, force);
 }
 
-void Mbc1::writeSaveFile() {
-  if (!savefile_opt) return;
+void Mbc1::hashState(Hasher &hasher) const {
+  ram.hashState(hasher);
+  hasher.updateValue(ram_enabled);
+  hasher.updateValue(rom_bank_lo);
+  hasher.updateValue(ram_bank_or_rom_bank_hi);
+  hasher.updateValue(bank_mode);
+}
 
-  std::ofstream out;
-  out.open(*savefile_opt, std::fstream::out | std::fstream::binary);
+void Mbc1::saveState(StateWriter &writer) const {
+  ram.saveState(writer);
+  writer.writeValue(ram_enabled);
+  writer.writeValue(rom_bank_lo);
+  writer.writeValue(ram_bank_or_rom_bank_hi);
+  writer.writeValue(bank_mode);
+}
 
-  std::ostreambuf_iterator<char> out_it(out);
-  std::copy(ram.begin(), ram.end(), out_it);
+void Mbc1::loadState(StateReader &reader) {
+  // What the game wrote before loading is still saved
+  writeSaveFile(true);
+  bool changed = false;
+  for (size_t bank = 0; bank < ram.pageCount(); bank++) {
+    if (ram.loadPage(reader, bank)) changed = true;
+  }
+  reader.readValue(ram_enabled);
+  reader.readValue(rom_bank_lo);
+  reader.readValue(ram_bank_or_rom_bank_hi);
+  reader.readValue(bank_mode);
+  if (changed && save) save->markReplaced();
+}
 
-  out.close();
+std::unique_ptr<Mbc> Mbc1::fork() {
+  // Made as a cartridge without a battery, so it has no save file
+  auto child = std::make_unique<Mbc1>("", 0x01, rom, ram.size());
+  child->ram.shareFrom(ram);
+  child->ram_enabled = ram_enabled;
+  child->rom_bank_lo = rom_bank_lo;
+  child->ram_bank_or_rom_bank_hi = ram_bank_or_rom_bank_hi;
+  child->bank_mode = bank_mode;
+  return child;
 }
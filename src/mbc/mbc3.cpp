@@ -1,14 +1,12 @@
 #include "mbc/mbc3.h"
 
-#include <chrono>
-#include <ctime>
-#include <fstream>
-#include <iterator>
+#include <algorithm>
 
-uint8_t Mbc3::readRomLo(uint16_t addr) { return rom[addr]; }
+uint8_t Mbc3::readRomLo(uint16_t addr) { return (*rom)[addr]; }
 
 uint8_t Mbc3::readRomHi(uint16_t addr) {
-  return rom[((static_cast<size_t>(rom_hi_bank) * 0x4000) + addr) % rom.size()];
+  size_t bank = rom_hi_bank;
+  return (*rom)[((bank * 0x4000) + addr) % rom->size()];
 }
 
 uint8_t Mbc3::readRam(uint16_t addr) {
@@ -36,12 +34,7 @@ void Mbc3::writeRomHi(uint16_t addr, uint8_t data) {
     bool old_rtc_latch = rtc_latch;
     rtc_latch = data & 1;
     if (!old_rtc_latch && rtc_latch && ((rtc[4] >> 6) & 1) == 0) {
-      const auto now = std::chrono::system_clock::now();
-      const auto epoch = now.time_since_epoch();
-      const auto chron_seconds =
-          std::chrono::duration_cast<std::chrono::seconds>(epoch);
-      uint64_t seconds =
-          static_cast<uint64_t>(chron_seconds.count()) - rtc_base;
+      uint64_t seconds = now() - rtc_base;
 
       rtc[0] = (seconds % 60);
       rtc[1] = ((seconds / 60) % 60);
@@ -60,18 +53,18 @@ void Mbc3::writeRomHi(uint16_t addr, uint8_t data) {
 void Mbc3::writeRam(uint16_t addr, uint8_t data) {
   if (!ram_rtc_enabled) return;
   if (ram_bank_or_rtc_reg < 0x04) {
-    ram[(static_cast<size_t>(ram_bank_or_rtc_reg) * 0x2000) + addr] = data;
+    size_t index = (static_cast<size_t>(ram_bank_or_rtc_reg) * 0x2000) + addr;
+    ram.write(index, data);
+    if (save) save->markDirty(index);
   } else if (ram_bank_or_rtc_reg >= 0x08) {
     rtc[ram_bank_or_rtc_reg - 0x08] = data;
     computeRtcBase();
+    if (save) save->markDirty();
   }
 }
 
 void Mbc3::computeRtcBase() {
-  const auto now = std::chrono::system_clock::now();
-  const auto epoch = now.time_since_epoch();
-  const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(epoch);
-  uint64_t diff = static_cast<uint64_t>(seconds.count());
+  uint64_t diff = now();
 
   diff -= rtc[0];
   diff -= static_cast<uint64_t>(rtc[1]) * 60;
@@ -84,83 +77,113 @@ void Mbc3::computeRtcBase() {
 // http://justsolve.archiveteam.org/wiki/GB#MBC3_RTC_save_format
 // TODO: Restoring RTC doesn't work, and saving RTC is wrong... but it's a start
 void Mbc3::restoreSaveFile(const bool restore_ram, const bool try_restore_rtc) {
-  if (!savefile_opt) return;
-
-  std::ifstream file_in;
-  file_in.open(*savefile_opt, std::fstream::in | std::fstream::binary);
-
-  if (file_in) {
-    file_in.seekg(0, std::ios::end);
-    std::streampos filesize = file_in.tellg();
-    file_in.seekg(0);
-
-    if (restore_ram) {
-      std::copy_n(std::istreambuf_iterator<char>(file_in),
-                  std::min(static_cast<size_t>(filesize), ram.capacity()),
-                  std::back_inserter(ram));
-    }
+  const std::vector<uint8_t> data = save->load();
+  size_t ram_bytes = 0;
+  if (restore_ram) {
+    ram_bytes = std::min(data.size(), ram.size());
+    ram.copyIn(data.data(), ram_bytes);
+  }
 
-    if (try_restore_rtc) {
-      std::vector<uint8_t> saved_time;
-      std::copy(std::istreambuf_iterator<char>(file_in),
-                std::istreambuf_iterator<char>(),
-                std::back_inserter(saved_time));
-
-      if (saved_time.size() >= 37) {
-        rtc_base = saved_time[0] + (60 * saved_time[4]) +
-                   (3600 * saved_time[8]) + (24 * 3600 * saved_time[12]) +
-                   (256 * 24 * 3600 * saved_time[16]);
-        rtc[0] = saved_time[20];
-        rtc[1] = saved_time[24];
-        rtc[2] = saved_time[28];
-        rtc[3] = saved_time[32];
-        rtc[4] = saved_time[36];
-      }
+  if (try_restore_rtc) {
+    const std::vector<uint8_t> saved_time(
+        data.begin() + static_cast<ptrdiff_t>(ram_bytes), data.end());
+
+    if (saved_time.size() >= 37) {
+      rtc_base = saved_time[0] + (60 * saved_time[4]) +
+                 (3600 * saved_time[8]) + (24 * 3600 * saved_time[12]) +
+                 (256 * 24 * 3600 * saved_time[16]);
+      rtc[0] = saved_time[20];
+      rtc[1] = saved_time[24];
+      rtc[2] = saved_time[28];
+      rtc[3] = saved_time[32];
+      rtc[4] = saved_time[36];
     }
   }
-
-  ram.resize(ram.capacity(), 0);
 }
 
-void Mbc3::writeSaveFile() {
-  if (!savefile_opt) return;
+void Mbc3::writeSaveFile(bool force) {
+  if (!save || !save->isFlushDue(force)) return;
+
+  // http://justsolve.archiveteam.org/wiki/GB#MBC3_RTC_save_format
+  // RTC data is stored in the first byte of each DWORD
+  std::vector<uint8_t> trailer;
+  trailer.reserve(4 * 10 + 8);
+  const auto push_byte = [&](uint8_t data) {
+    trailer.push_back(data);
+    trailer.insert(trailer.end(), 3, 0);
+  };
 
-  std::ofstream out;
-  out.open(*savefile_opt, std::fstream::out | std::fstream::binary);
+  push_byte(static_cast<uint8_t>(rtc_base % 60));
+  push_byte(static_cast<uint8_t>((rtc_base / 60) % 60));
+  push_byte(static_cast<uint8_t>((rtc_base / 3600) % 24));
 
-  std::ostreambuf_iterator<char> out_it(out);
-  std::copy(ram.begin(), ram.end(), out_it);
+  auto days = rtc_base / (3600 * 24);
+  push_byte(static_cast<uint8_t>(days));
+  push_byte(static_cast<uint8_t>((days >> 8) & 1));
 
-  {
-    // http://justsolve.archiveteam.org/wiki/GB#MBC3_RTC_save_format
-    // RTC data is stored in the first byte of each DWORD
-    const auto push_byte = [&](char data) {
-      (*out_it++) = data;
-      for (int i = 0; i < 3; i++) (*out_it++) = 0;
-    };
+  for (uint8_t rtc_byte : rtc) {
+    push_byte(rtc_byte);
+  }
 
-    push_byte(rtc_base % 60);
-    push_byte((rtc_base / 60) % 60);
-    push_byte((rtc_base / 3600) % 24);
+  const uint64_t seconds = now();
+  for (size_t byte_n = 0; byte_n < 8; byte_n++) {
+    trailer.push_back(static_cast<uint8_t>(seconds >> (8 * byte_n)));
+  }
 
-    auto days = rtc_base / (3600 * 24);
-    push_byte(static_cast<char>(days));
-    push_byte(static_cast<char>((days >> 8) & 1));
+  save->flush(ram, trailer, force);
+}
 
-    for (uint8_t rtc_byte : rtc) {
-      push_byte(static_cast<char>(rtc_byte));
-    }
+void Mbc3::hashState(Hasher &hasher) const {
+  ram.hashState(hasher);
+  hasher.updateValue(ram_rtc_enabled);
+  hasher.updateValue(rtc_latch);
+  hasher.updateValue(rom_hi_bank);
+  hasher.updateValue(ram_bank_or_rtc_reg);
+  hasher.update(rtc, sizeof(rtc));
+  hasher.updateValue(rtc_base);
+}
 
-    const auto now = std::chrono::system_clock::now();
-    const auto epoch = now.time_since_epoch();
-    const auto seconds_chron =
-        std::chrono::duration_cast<std::chrono::seconds>(epoch);
-    uint64_t seconds = static_cast<uint64_t>(seconds_chron.count());
+void Mbc3::saveState(StateWriter &writer) const {
+  ram.saveState(writer);
+  writer.writeValue(ram_rtc_enabled);
+  writer.writeValue(rtc_latch);
+  writer.writeValue(rom_hi_bank);
+  writer.writeValue(ram_bank_or_rtc_reg);
+  writer.write(rtc, sizeof(rtc));
+  writer.writeValue(rtc_base);
+}
 
-    for (size_t byte_n = 0; byte_n < 8; byte_n++) {
-      (*out_it++) = static_cast<char>(seconds >> (8 * byte_n));
-    }
+void Mbc3::loadState(StateReader &reader) {
+  // What the game wrote before loading is still saved
+  writeSaveFile(true);
+  bool changed = false;
+  for (size_t bank = 0; bank < ram.pageCount(); bank++) {
+    if (ram.loadPage(reader, bank)) changed = true;
   }
+  reader.readValue(ram_rtc_enabled);
+  reader.readValue(rtc_latch);
+  reader.readValue(rom_hi_bank);
+  reader.readValue(ram_bank_or_rtc_reg);
+  uint8_t new_rtc[5];
+  uint64_t new_rtc_base;
+  reader.read(new_rtc, sizeof(new_rtc));
+  reader.readValue(new_rtc_base);
+  const bool rtc_changed =
+      !std::equal(new_rtc, new_rtc + 5, rtc) || new_rtc_base != rtc_base;
+  std::copy_n(new_rtc, 5, rtc);
+  rtc_base = new_rtc_base;
+  if ((changed || rtc_changed) && save) save->markReplaced();
+}
 
-  out.close();
+std::unique_ptr<Mbc> Mbc3::fork() {
+  // Made as a cartridge without a battery, so it has no save file
+  auto child = std::make_unique<Mbc3>("", 0x12, rom, ram.size());
+  child->ram.shareFrom(ram);
+  child->ram_rtc_enabled = ram_rtc_enabled;
+  child->rtc_latch = rtc_latch;
+  child->rom_hi_bank = rom_hi_bank;
+  child->ram_bank_or_rtc_reg = ram_bank_or_rtc_reg;
+  std::copy_n(rtc, sizeof(rtc), child->rtc);
+  child->rtc_base = rtc_base;
+  return child;
 }
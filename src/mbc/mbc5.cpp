@@ -1,12 +1,12 @@
 #include "mbc/mbc5.h"
 
-#include <fstream>
+#include <algorithm>
 
-uint8_t Mbc5::readRomLo(uint16_t addr) { return rom[addr]; }
+uint8_t Mbc5::readRomLo(uint16_t addr) { return (*rom)[addr]; }
 
 uint8_t Mbc5::readRomHi(uint16_t addr) {
   size_t bank = static_cast<size_t>(rom_bank_hi << 8) | rom_bank_lo;
-  return rom[((bank * 0x4000) + addr) % rom.size()];
+  return (*rom)[((bank * 0x4000) + addr) % rom->size()];
 }
 
 uint8_t Mbc5::readRam(uint16_t addr) {
@@ -32,36 +32,57 @@ void Mbc5::writeRomHi(uint16_t addr, uint8_t data) {
 
 void Mbc5::writeRam(uint16_t addr, uint8_t data) {
   if (!ram_enabled) return;
-  ram[((static_cast<size_t>(ram_bank) * 0x2000) + addr) % ram.size()] = data;
+  size_t index = ((static_cast<size_t>(ram_bank) * 0x2000) + addr) % ram.size();
+  ram.write(index, data);
+  if (save) save->markDirty(index);
 }
 
 void Mbc5::restoreSaveFile() {
-  if (!savefile_opt) return;
-
-  std::ifstream file_in;
-  file_in.open(*savefile_opt, std::fstream::in | std::fstream::binary);
-
-  if (file_in) {
-    file_in.seekg(0, std::ios::end);
-    std::streampos filesize = file_in.tellg();
-    file_in.seekg(0);
-
-    std::copy_n(std::istreambuf_iterator<char>(file_in),
-                std::min(static_cast<size_t>(filesize), ram.capacity()),
-                std::back_inserter(ram));
-  }
+  const std::vector<uint8_t> data = save->load();
+  ram.copyIn(data.data(), data.size());
+}
 
-  ram.resize(ram.capacity(), 0);
+void Mbc5::writeSaveFile(bool force) {
+  if (save) save->flush(ram, {}, force);
 }
 
-void Mbc5::writeSaveFile() {
-  if (!savefile_opt) return;
+void Mbc5::hashState(Hasher &hasher) const {
+  ram.hashState(hasher);
+  hasher.updateValue(ram_enabled);
+  hasher.updateValue(rom_bank_lo);
+  hasher.updateValue(ram_bank);
+  hasher.updateValue(rom_bank_hi);
+}
 
-  std::ofstream out;
-  out.open(*savefile_opt, std::fstream::out | std::fstream::binary);
+void Mbc5::saveState(StateWriter &writer) const {
+  ram.saveState(writer);
+  writer.writeValue(ram_enabled);
+  writer.writeValue(rom_bank_lo);
+  writer.writeValue(ram_bank);
+  writer.writeValue(rom_bank_hi);
+}
 
-  std::ostreambuf_iterator<char> out_it(out);
-  std::copy(ram.begin(), ram.end(), out_it);
+void Mbc5::loadState(StateReader &reader) {
+  // What the game wrote before loading is still saved
+  writeSaveFile(true);
+  bool changed = false;
+  for (size_t bank = 0; bank < ram.pageCount(); bank++) {
+    if (ram.loadPage(reader, bank)) changed = true;
+  }
+  reader.readValue(ram_enabled);
+  reader.readValue(rom_bank_lo);
+  reader.readValue(ram_bank);
+  reader.readValue(rom_bank_hi);
+  if (changed && save) save->markReplaced();
+}
 
-  out.close();
+std::unique_ptr<Mbc> Mbc5::fork() {
+  // Made as a cartridge without a battery, so it has no save file
+  auto child = std::make_unique<Mbc5>("", 0x1A, rom, ram.size());
+  child->ram.shareFrom(ram);
+  child->ram_enabled = ram_enabled;
+  child->rom_bank_lo = rom_bank_lo;
+  child->ram_bank = ram_bank;
+  child->rom_bank_hi = rom_bank_hi;
+  return child;
 }
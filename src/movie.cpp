@@ -0,0 +1,247 @@
+#include "movie.h"
+
+#include <cstring>
+#include <sstream>
+
+#include "hash.h"
+#include "state_delta.h"
+
+namespace {
+
+const char kMovieMagic[8] = {'D', 'O', 'D', 'O', 'M', 'O', 'V', 'I'};
+const uint32_t kMovieVersion = 2;
+
+// Record types
+const uint8_t kInput = 0;
+const uint8_t kHash = 1;
+const uint8_t kLoad = 2;
+
+std::string outOfStep(uint64_t dots, const char *what) {
+  std::stringstream sstream;
+  sstream << "Replay went out of step at dot " << dots << ": " << what;
+  return sstream.str();
+}
+
+}  // namespace
+
+std::variant<std::unique_ptr<MovieWriter>, std::string> MovieWriter::create(
+    const std::string &filename, Gameboy &gameboy) {
+  std::unique_ptr<MovieWriter> writer(new MovieWriter());
+  writer->file.open(filename, std::ios::binary | std::ios::trunc);
+  if (!writer->file) return "Couldn't create movie: " + filename;
+
+  gameboy.saveState(writer->state);
+  StateWriter header(writer->record);
+  header.write(kMovieMagic, sizeof(kMovieMagic));
+  header.writeValue(kMovieVersion);
+  header.writeValue(gameboy.getRtcSeed());
+  const uint64_t state_size = writer->state.size();
+  header.writeValue(state_size);
+  header.write(writer->state.data(), writer->state.size());
+  writer->writeRecord();
+  writer->base.swap(writer->state);
+
+  writer->last_dots = gameboy.getElapsedDots();
+  writer->next_hash_dots = writer->last_dots;
+  return writer;
+}
+
+std::optional<std::string> MovieWriter::finish(Gameboy &gameboy) {
+  recordHash(gameboy);
+  file.close();
+  if (file.fail()) return "Couldn't write movie";
+  return {};
+}
+
+void MovieWriter::recordInput(Gameboy &gameboy, uint8_t buttons) {
+  const uint64_t dots = gameboy.getElapsedDots();
+  if (buttons != last_buttons) {
+    StateWriter writer(record);
+    beginRecord(writer, kInput, dots);
+    writer.writeValue(buttons);
+    writeRecord();
+    last_buttons = buttons;
+  }
+  if (dots >= next_hash_dots) recordHash(gameboy);
+}
+
+void MovieWriter::recordLoad(Gameboy &gameboy, uint64_t dots_before) {
+  // States for a cartridge are all one size, so the delta always fits
+  gameboy.saveState(state);
+  encodeDelta(base.data(), state.data(), state.size(), delta);
+  base.swap(state);
+  StateWriter writer(record);
+  beginRecord(writer, kLoad, dots_before);
+  writer.writeVarint(delta.size());
+  writer.write(delta.data(), delta.size());
+  writeRecord();
+
+  // The loaded state has its own time and buttons
+  last_dots = gameboy.getElapsedDots();
+  next_hash_dots = last_dots;
+  last_buttons = -1;
+}
+
+void MovieWriter::beginRecord(StateWriter &writer, uint8_t type,
+                              uint64_t dots) {
+  writer.writeValue(type);
+  writer.writeVarint(dots - last_dots);
+  last_dots = dots;
+}
+
+void MovieWriter::writeRecord() {
+  file.write(reinterpret_cast<const char *>(record.data()),
+             static_cast<std::streamsize>(record.size()));
+}
+
+void MovieWriter::recordHash(Gameboy &gameboy) {
+  const uint64_t dots = gameboy.getElapsedDots();
+  StateWriter writer(record);
+  beginRecord(writer, kHash, dots);
+  writer.writeValue(gameboy.getStateHash());
+  writeRecord();
+  next_hash_dots = dots + kHashInterval;
+}
+
+std::variant<std::unique_ptr<MoviePlayer>, std::string> MoviePlayer::open(
+    const std::string &filename) {
+  auto file_result = MappedFile::open(filename);
+  if (std::holds_alternative<std::string>(file_result)) {
+    return std::get<std::string>(file_result);
+  }
+  std::unique_ptr<MoviePlayer> player(new MoviePlayer());
+  player->file = std::move(std::get<0>(file_result));
+
+  StateReader reader(player->file->data(), player->file->size());
+  char magic[sizeof(kMovieMagic)];
+  uint32_t version;
+  uint64_t state_size;
+  reader.read(magic, sizeof(magic));
+  reader.readValue(version);
+  reader.readValue(player->rtc_seed);
+  reader.readValue(state_size);
+  if (!reader.ok() || std::memcmp(magic, kMovieMagic, sizeof(magic)) != 0) {
+    return "Not a movie: " + filename;
+  }
+  if (version != kMovieVersion) {
+    return "Unsupported movie version: " + filename;
+  }
+  if (state_size > reader.remaining()) {
+    return "Movie is truncated: " + filename;
+  }
+  player->state_offset = player->file->size() - reader.remaining();
+  player->state_size = state_size;
+  player->records = player->file->data() + player->state_offset + state_size;
+  player->records_size = reader.remaining() - state_size;
+  player->hash = Hasher::hash(player->file->data(), player->file->size());
+  return player;
+}
+
+std::optional<std::string> MoviePlayer::start(Gameboy &gameboy) {
+  // The movie's states replace cartridge RAM, which mustn't reach the save
+  gameboy.detachSave();
+  gameboy.setRtcMode(RtcMode::kEmulated);
+  const uint8_t *state = file->data() + state_offset;
+  auto error_msg = gameboy.loadState(state, state_size);
+  if (error_msg) return error_msg;
+  base.assign(state, state + state_size);
+  offset = 0;
+  dots = gameboy.getElapsedDots();
+  return {};
+}
+
+std::optional<std::string> MoviePlayer::play(Gameboy &gameboy,
+                                             uint64_t max_frames) {
+  const uint64_t until_frame =
+      max_frames > UINT64_MAX - frames ? UINT64_MAX : frames + max_frames;
+  while (offset < records_size) {
+    StateReader reader(records + offset, records_size - offset);
+    uint8_t type;
+    reader.readValue(type);
+    const uint64_t record_dots = dots + reader.readVarint();
+    if (!reader.ok()) return "Movie is truncated";
+    if (!runUntil(gameboy, record_dots, until_frame)) {
+      return outOfStep(record_dots, "no instruction ends there");
+    }
+    if (gameboy.getElapsedDots() < record_dots) return {};
+
+    switch (type) {
+      case kInput: {
+        uint8_t buttons;
+        reader.readValue(buttons);
+        if (!reader.ok()) break;
+        gameboy.setButtonsPressed(buttons >> 4, buttons & 0xF);
+        break;
+      }
+      case kHash: {
+        uint64_t state_hash;
+        reader.readValue(state_hash);
+        if (!reader.ok()) break;
+        if (state_hash != gameboy.getStateHash()) {
+          return outOfStep(record_dots, "the state hash differs");
+        }
+        hashes_checked++;
+        break;
+      }
+      case kLoad: {
+        const size_t size = reader.readVarint();
+        const uint8_t *load_delta = reader.take(size);
+        if (!load_delta) break;
+        applyDelta(load_delta, size, base.data(), base.size());
+        auto error_msg = gameboy.loadState(base.data(), base.size());
+        if (error_msg) return error_msg;
+        break;
+      }
+      default:
+        return "Movie is corrupt";
+    }
+    if (!reader.ok()) return "Movie is truncated";
+
+    offset = records_size - reader.remaining();
+    dots = type == kLoad ? gameboy.getElapsedDots() : record_dots;
+  }
+  return {};
+}
+
+void MoviePlayer::savePosition(StateWriter &writer) const {
+  writer.writeValue(hash);
+  writer.writeValue(offset);
+  writer.writeValue(dots);
+
+  // The base, as a delta from the starting state, which is small until
+  // there are loads
+  std::vector<uint8_t> base_delta;
+  encodeDelta(file->data() + state_offset, base.data(), base.size(),
+              base_delta);
+  writer.writeVarint(base_delta.size());
+  writer.write(base_delta.data(), base_delta.size());
+}
+
+bool MoviePlayer::loadPosition(StateReader &reader) {
+  uint64_t position_hash;
+  size_t new_offset;
+  uint64_t new_dots;
+  reader.readValue(position_hash);
+  reader.readValue(new_offset);
+  reader.readValue(new_dots);
+  const size_t base_delta_size = reader.readVarint();
+  const uint8_t *base_delta = reader.take(base_delta_size);
+  if (!reader.ok() || position_hash != hash || new_offset > records_size ||
+      base.size() != state_size) {
+    return false;
+  }
+  offset = new_offset;
+  dots = new_dots;
+  const uint8_t *state = file->data() + state_offset;
+  base.assign(state, state + state_size);
+  applyDelta(base_delta, base_delta_size, base.data(), base.size());
+  return true;
+}
+
+bool MoviePlayer::runUntil(Gameboy &gameboy, uint64_t until_dots,
+                           uint64_t until_frame) {
+  while (gameboy.getElapsedDots() < until_dots && frames < until_frame) {
+    if (gameboy.step()) frames++;
+  }
+  return gameboy.getElapsedDots() <= until_dots;
+}
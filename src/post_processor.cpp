@@ -0,0 +1,291 @@
+#include "post_processor.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+
+namespace {
+
+// Averages two XRGB8888 pixels per channel without unpacking them
+uint32_t blend(uint32_t a, uint32_t b) {
+  return (a & b) + (((a ^ b) & 0xFEFEFEFE) >> 1);
+}
+
+// A perceptual distance that weighs luma over chroma, as xBR does
+int colorDistance(uint32_t a, uint32_t b) {
+  auto channel = [](uint32_t c, int shift) {
+    return static_cast<int>((c >> shift) & 0xFF);
+  };
+  int dr = channel(a, 16) - channel(b, 16);
+  int dg = channel(a, 8) - channel(b, 8);
+  int db = channel(a, 0) - channel(b, 0);
+
+  int y = 299 * dr + 587 * dg + 114 * db;
+  int u = -169 * dr - 331 * dg + 500 * db;
+  int v = 500 * dr - 419 * dg - 81 * db;
+  return (48 * std::abs(y) + 7 * std::abs(u) + 6 * std::abs(v)) / 1000;
+}
+
+}  // namespace
+
+void PostProcessor::Image::fillBorder() {
+  for (size_t y = 0; y < height; y++) {
+    uint32_t *r = row(y);
+    for (size_t i = 1; i <= kBorder; i++) {
+      r[-static_cast<ptrdiff_t>(i)] = r[0];
+      r[width - 1 + i] = r[width - 1];
+    }
+  }
+  for (size_t i = 1; i <= kBorder; i++) {
+    std::copy_n(row(0) - kBorder, pitch(), row(0) - kBorder - i * pitch());
+    std::copy_n(row(height - 1) - kBorder, pitch(),
+                row(height - 1) - kBorder + i * pitch());
+  }
+}
+
+PostProcessor::PostProcessor(ScaleFilter filter_, int scale_)
+    : filter(filter_),
+      scale(scale_),
+      pool(ThreadPool::shared()),
+      color_lut(std::make_unique<std::array<uint32_t, 0x8000>>()),
+      frame_blending(false),
+      have_previous(false),
+      previous(160 * 144),
+      input(160, 144),
+      intermediate(320, 288) {
+  switch (filter) {
+    case ScaleFilter::kNearest:
+      scale = std::clamp(scale, 1, 8);
+      break;
+    case ScaleFilter::kScale2x:
+    case ScaleFilter::kXbr2x:
+      scale = 2;
+      break;
+    case ScaleFilter::kScale3x:
+      scale = 3;
+      break;
+    case ScaleFilter::kScale4x:
+    case ScaleFilter::kXbr4x:
+      scale = 4;
+      break;
+  }
+
+  setColorCorrection(false);
+}
+
+void PostProcessor::setColorCorrection(bool enabled) {
+  for (uint32_t c = 0; c < 0x8000; c++) {
+    uint32_t r = c & 0x1F;
+    uint32_t g = (c >> 5) & 0x1F;
+    uint32_t b = (c >> 10) & 0x1F;
+
+    if (enabled) {
+      // Mix the channels and compress the range, as the CGB LCD does
+      uint32_t r_mix = r * 26 + g * 4 + b * 2;
+      uint32_t g_mix = g * 24 + b * 8;
+      uint32_t b_mix = r * 6 + g * 4 + b * 22;
+      (*color_lut)[c] = (std::min(r_mix, 960u) >> 2) << 16 |
+                        (std::min(g_mix, 960u) >> 2) << 8 |
+                        std::min(b_mix, 960u) >> 2;
+    } else {
+      // Expand 5 bits to 8 so white stays white
+      (*color_lut)[c] = (r << 3 | r >> 2) << 16 | (g << 3 | g >> 2) << 8 |
+                        (b << 3 | b >> 2);
+    }
+  }
+}
+
+void PostProcessor::setFrameBlending(bool enabled) {
+  frame_blending = enabled;
+  have_previous = false;
+}
+
+template <typename Func>
+void PostProcessor::forBands(size_t rows, const Func &func) {
+  pool.parallelFor(rows, pool.size() + 1, func);
+}
+
+void PostProcessor::process(const Frame &frame, uint32_t *out, size_t pitch) {
+  forBands(144, [&](size_t begin, size_t end) {
+    convert(frame, begin, end);
+    if (frame_blending && have_previous) blendPrevious(begin, end);
+  });
+  if (frame_blending && !have_previous) {
+    for (size_t y = 0; y < 144; y++) {
+      std::copy_n(input.row(y), 160, &previous[y * 160]);
+    }
+    have_previous = true;
+  }
+  input.fillBorder();
+
+  switch (filter) {
+    case ScaleFilter::kNearest:
+      forBands(144, [&](size_t begin, size_t end) {
+        nearest(input, out, pitch, scale, begin, end);
+      });
+      break;
+    case ScaleFilter::kScale2x:
+      forBands(144, [&](size_t begin, size_t end) {
+        scale2x(input, out, pitch, begin, end);
+      });
+      break;
+    case ScaleFilter::kScale3x:
+      forBands(144, [&](size_t begin, size_t end) {
+        scale3x(input, out, pitch, begin, end);
+      });
+      break;
+    case ScaleFilter::kScale4x:
+      forBands(144, [&](size_t begin, size_t end) {
+        scale2x(input, intermediate.row(0), intermediate.pitch(), begin, end);
+      });
+      intermediate.fillBorder();
+      forBands(288, [&](size_t begin, size_t end) {
+        scale2x(intermediate, out, pitch, begin, end);
+      });
+      break;
+    case ScaleFilter::kXbr2x:
+      forBands(144, [&](size_t begin, size_t end) {
+        xbr2x(input, out, pitch, begin, end);
+      });
+      break;
+    case ScaleFilter::kXbr4x:
+      forBands(144, [&](size_t begin, size_t end) {
+        xbr2x(input, intermediate.row(0), intermediate.pitch(), begin, end);
+      });
+      intermediate.fillBorder();
+      forBands(288, [&](size_t begin, size_t end) {
+        xbr2x(intermediate, out, pitch, begin, end);
+      });
+      break;
+  }
+}
+
+void PostProcessor::convert(const Frame &frame, size_t begin, size_t end) {
+  for (size_t y = begin; y < end; y++) {
+    const Line &line = frame[y];
+    uint32_t *dst = input.row(y);
+    for (size_t x = 0; x < 160; x++) {
+      dst[x] = (*color_lut)[line[x] & 0x7FFF];
+    }
+  }
+}
+
+void PostProcessor::blendPrevious(size_t begin, size_t end) {
+  for (size_t y = begin; y < end; y++) {
+    uint32_t *current = input.row(y);
+    uint32_t *prev = &previous[y * 160];
+    for (size_t x = 0; x < 160; x++) {
+      uint32_t c = current[x];
+      current[x] = blend(c, prev[x]);
+      prev[x] = c;
+    }
+  }
+}
+
+void PostProcessor::nearest(const Image &src, uint32_t *dst, size_t pitch,
+                            int n, size_t begin, size_t end) {
+  const size_t un = static_cast<size_t>(n);
+  for (size_t y = begin; y < end; y++) {
+    const uint32_t *s = src.row(y);
+    uint32_t *d = dst + y * un * pitch;
+    for (size_t x = 0; x < src.width; x++) {
+      std::fill_n(d + x * un, un, s[x]);
+    }
+    for (size_t i = 1; i < un; i++) {
+      std::copy_n(d, src.width * un, d + i * pitch);
+    }
+  }
+}
+
+// The inner loops of the EPX-style filters below only select between
+// neighbours, so the compiler can turn them into vector compares and blends
+
+void PostProcessor::scale2x(const Image &src, uint32_t *dst, size_t pitch,
+                            size_t begin, size_t end) {
+  for (size_t y = begin; y < end; y++) {
+    const uint32_t *above = src.row(y) - src.pitch();
+    const uint32_t *mid = src.row(y);
+    const uint32_t *below = src.row(y) + src.pitch();
+    uint32_t *d0 = dst + 2 * y * pitch;
+    uint32_t *d1 = d0 + pitch;
+
+    for (size_t x = 0; x < src.width; x++) {
+      uint32_t b = above[x], h = below[x];
+      uint32_t d = (mid - 1)[x], e = mid[x], f = (mid + 1)[x];
+      bool edge = b != h && d != f;
+      d0[2 * x] = edge && d == b ? d : e;
+      d0[2 * x + 1] = edge && b == f ? f : e;
+      d1[2 * x] = edge && d == h ? d : e;
+      d1[2 * x + 1] = edge && h == f ? f : e;
+    }
+  }
+}
+
+void PostProcessor::scale3x(const Image &src, uint32_t *dst, size_t pitch,
+                            size_t begin, size_t end) {
+  for (size_t y = begin; y < end; y++) {
+    const uint32_t *above = src.row(y) - src.pitch();
+    const uint32_t *mid = src.row(y);
+    const uint32_t *below = src.row(y) + src.pitch();
+    uint32_t *d0 = dst + 3 * y * pitch;
+    uint32_t *d1 = d0 + pitch;
+    uint32_t *d2 = d1 + pitch;
+
+    for (size_t x = 0; x < src.width; x++) {
+      uint32_t a = (above - 1)[x], b = above[x], c = (above + 1)[x];
+      uint32_t d = (mid - 1)[x], e = mid[x], f = (mid + 1)[x];
+      uint32_t g = (below - 1)[x], h = below[x], i = (below + 1)[x];
+
+      bool edge = b != h && d != f;
+      bool db = edge && d == b, bf = edge && b == f;
+      bool dh = edge && d == h, hf = edge && h == f;
+
+      d0[3 * x] = db ? d : e;
+      d0[3 * x + 1] = (db && e != c) || (bf && e != a) ? b : e;
+      d0[3 * x + 2] = bf ? f : e;
+      d1[3 * x] = (db && e != g) || (dh && e != a) ? d : e;
+      d1[3 * x + 1] = e;
+      d1[3 * x + 2] = (bf && e != i) || (hf && e != c) ? f : e;
+      d2[3 * x] = dh ? d : e;
+      d2[3 * x + 1] = (dh && e != i) || (hf && e != g) ? h : e;
+      d2[3 * x + 2] = hf ? f : e;
+    }
+  }
+}
+
+void PostProcessor::xbr2x(const Image &src, uint32_t *dst, size_t pitch,
+                          size_t begin, size_t end) {
+  const ptrdiff_t row_step = static_cast<ptrdiff_t>(src.pitch());
+
+  // Decides one output corner of the pixel at p. The rule is written for the
+  // bottom-right corner; the other corners mirror it through dx and dy.
+  auto corner = [](const uint32_t *p, ptrdiff_t dx, ptrdiff_t dy) {
+    auto at = [&](ptrdiff_t i, ptrdiff_t j) { return p[i * dx + j * dy]; };
+    uint32_t e = at(0, 0), f = at(1, 0), h = at(0, 1), i = at(1, 1);
+
+    // Compare the edge along H-F against the one along E-I
+    int along_hf = colorDistance(e, at(1, -1)) + colorDistance(e, at(-1, 1)) +
+                   colorDistance(i, at(2, 0)) + colorDistance(i, at(0, 2)) +
+                   4 * colorDistance(h, f);
+    int along_ei = colorDistance(h, at(-1, 0)) + colorDistance(h, at(1, 2)) +
+                   colorDistance(f, at(2, 1)) + colorDistance(f, at(0, -1)) +
+                   4 * colorDistance(e, i);
+    if (along_hf >= along_ei) return e;
+
+    uint32_t closer = colorDistance(e, f) <= colorDistance(e, h) ? f : h;
+    return blend(e, closer);
+  };
+
+  for (size_t y = begin; y < end; y++) {
+    const uint32_t *s = src.row(y);
+    uint32_t *d0 = dst + 2 * y * pitch;
+    uint32_t *d1 = d0 + pitch;
+
+    for (size_t x = 0; x < src.width; x++) {
+      d0[2 * x] = corner(s + x, -1, -row_step);
+      d0[2 * x + 1] = corner(s + x, 1, -row_step);
+      d1[2 * x] = corner(s + x, -1, row_step);
+      d1[2 * x + 1] = corner(s + x, 1, row_step);
+    }
+  }
+}
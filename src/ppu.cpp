@@ -2,7 +2,6 @@
 
 #include <algorithm>
 #include <iostream>
-#include <vector>
 
 uint8_t Ppu::tick(int ppu_ticks) {
   if (((control >> 7) & 1) == 0) return 0;
@@ -14,8 +13,8 @@ uint8_t Ppu::tick(int ppu_ticks) {
     this->ppu_tick_divider += delta_t;
 
     // Progress a line every 456 dots
-    while (this->ppu_tick_divider >= 4 * 114) {
-      this->ppu_tick_divider -= 4 * 114;
+    while (this->ppu_tick_divider >= kDotsPerLine) {
+      this->ppu_tick_divider -= kDotsPerLine;
       this->lcd_y = (this->lcd_y + 1) % 154;
 
       if (this->compare_interrupt && (this->lcd_y == this->lcd_y_compare)) {
@@ -30,6 +29,8 @@ uint8_t Ppu::tick(int ppu_ticks) {
 
         window_start_line = -1;
         window_internal_line = 0;
+
+        endFrame();
       }
     }
 
@@ -42,9 +43,6 @@ uint8_t Ppu::tick(int ppu_ticks) {
         }
       } else if (this->ppu_tick_divider < 80 + 172) {
         if (this->stat_mode != kModeTransfer) {
-          // if (this->lcd_y == 0)
-          //   std::fill(framebuffer.begin(), framebuffer.end(),
-          //             std::array<uint16_t, 160>{0x7FFF});
           drawLine();
           this->stat_mode = kModeTransfer;
           if (this->mode_3_interrupt) interrupts |= kIntMaskStat;
@@ -61,6 +59,137 @@ uint8_t Ppu::tick(int ppu_ticks) {
   return interrupts;
 }
 
+int Ppu::ticksUntilNextEvent() const {
+  // Nothing happens with the LCD off, but check back once a frame anyway
+  if (((control >> 7) & 1) == 0) return kDotsPerFrame;
+
+  if (lcd_y < 144) {
+    if (mode_3_interrupt && ppu_tick_divider < 80) {
+      return 80 - ppu_tick_divider;
+    }
+    if (mode_0_interrupt && ppu_tick_divider < 80 + 172) {
+      return 80 + 172 - ppu_tick_divider;
+    }
+  }
+
+  const int to_line_end = kDotsPerLine - ppu_tick_divider;
+  if (compare_interrupt || mode_0_interrupt || mode_2_interrupt ||
+      mode_3_interrupt) {
+    return to_line_end;
+  }
+
+  // Otherwise, only the start of the next VBlank matters
+  const int lines_after = (lcd_y < 144 ? 144 : 154 + 144) - lcd_y - 1;
+  return to_line_end + lines_after * kDotsPerLine;
+}
+
+void Ppu::hashState(Hasher &hasher) const {
+  hasher.update(vram.data(), vram.size());
+  hasher.update(oam.data(), oam.size());
+  hasher.updateValue(ppu_tick_divider);
+  hasher.updateValue(vram_bank);
+  hasher.updateValue(cgb_mode);
+  hasher.updateValue(control);
+  hasher.updateValue(compare_interrupt);
+  hasher.updateValue(mode_0_interrupt);
+  hasher.updateValue(mode_1_interrupt);
+  hasher.updateValue(mode_2_interrupt);
+  hasher.updateValue(mode_3_interrupt);
+  hasher.updateValue(stat_mode);
+  hasher.updateValue(scroll_x);
+  hasher.updateValue(scroll_y);
+  hasher.updateValue(lcd_y);
+  hasher.updateValue(lcd_y_compare);
+  hasher.updateValue(window_x);
+  hasher.updateValue(window_y);
+  hasher.updateValue(dmg_bg_palette);
+  hasher.update(dmg_obj_palette, sizeof(dmg_obj_palette));
+  hasher.updateValue(cgb_bg_palette_index);
+  hasher.updateValue(cgb_obj_palette_index);
+  hasher.updateValue(cgb_bg_palette_auto_incr);
+  hasher.updateValue(cgb_obj_palette_auto_incr);
+  hasher.update(cgb_bg_palette, sizeof(cgb_bg_palette));
+  hasher.update(cgb_obj_palette, sizeof(cgb_obj_palette));
+  hasher.updateValue(window_start_line);
+  hasher.updateValue(window_internal_line);
+}
+
+void Ppu::saveState(StateWriter &writer) const {
+  writer.write(vram.data(), vram.size());
+  writer.write(oam.data(), oam.size());
+  writer.writeValue(ppu_tick_divider);
+  writer.writeValue(vram_bank);
+  writer.writeValue(cgb_mode);
+  writer.writeValue(control);
+  writer.writeValue(compare_interrupt);
+  writer.writeValue(mode_0_interrupt);
+  writer.writeValue(mode_1_interrupt);
+  writer.writeValue(mode_2_interrupt);
+  writer.writeValue(mode_3_interrupt);
+  writer.writeValue(stat_mode);
+  writer.writeValue(scroll_x);
+  writer.writeValue(scroll_y);
+  writer.writeValue(lcd_y);
+  writer.writeValue(lcd_y_compare);
+  writer.writeValue(window_x);
+  writer.writeValue(window_y);
+  writer.writeValue(dmg_bg_palette);
+  writer.write(dmg_obj_palette, sizeof(dmg_obj_palette));
+  writer.writeValue(cgb_bg_palette_index);
+  writer.writeValue(cgb_obj_palette_index);
+  writer.writeValue(cgb_bg_palette_auto_incr);
+  writer.writeValue(cgb_obj_palette_auto_incr);
+  writer.write(cgb_bg_palette, sizeof(cgb_bg_palette));
+  writer.write(cgb_obj_palette, sizeof(cgb_obj_palette));
+  writer.writeValue(window_start_line);
+  writer.writeValue(window_internal_line);
+}
+
+void Ppu::loadState(StateReader &reader) {
+  reader.read(vram.data(), vram.size());
+  reader.read(oam.data(), oam.size());
+  reader.readValue(ppu_tick_divider);
+  reader.readValue(vram_bank);
+  reader.readValue(cgb_mode);
+  reader.readValue(control);
+  reader.readValue(compare_interrupt);
+  reader.readValue(mode_0_interrupt);
+  reader.readValue(mode_1_interrupt);
+  reader.readValue(mode_2_interrupt);
+  reader.readValue(mode_3_interrupt);
+  stat_mode = reader.readEnum(kModeTransfer, kModeOamSearch);
+  reader.readValue(scroll_x);
+  reader.readValue(scroll_y);
+  reader.readValue(lcd_y);
+  reader.readValue(lcd_y_compare);
+  reader.readValue(window_x);
+  reader.readValue(window_y);
+  reader.readValue(dmg_bg_palette);
+  reader.read(dmg_obj_palette, sizeof(dmg_obj_palette));
+  reader.readValue(cgb_bg_palette_index);
+  reader.readValue(cgb_obj_palette_index);
+  reader.readValue(cgb_bg_palette_auto_incr);
+  reader.readValue(cgb_obj_palette_auto_incr);
+  reader.read(cgb_bg_palette, sizeof(cgb_bg_palette));
+  reader.read(cgb_obj_palette, sizeof(cgb_obj_palette));
+  reader.readValue(window_start_line);
+  reader.readValue(window_internal_line);
+
+  // Anything used as an index is kept in range, as the registers keep it
+  ppu_tick_divider = std::clamp(ppu_tick_divider, 0, kDotsPerLine - 1);
+  if (lcd_y >= 154) lcd_y = 0;
+  cgb_bg_palette_index &= 0x3F;
+  cgb_obj_palette_index &= 0x3F;
+
+  // The threaded renderers hold their own copies of VRAM and OAM. Loading
+  // happens every frame with run-ahead, so they're refreshed in place
+  // rather than rebuilt.
+  renderer.invalidateSprites();
+  if (worker) worker->reload(vram, oam);
+  if (deferred) deferred->reload(vram, oam);
+  checked_lines.reset();
+}
+
 uint8_t Ppu::read(uint16_t addr) {
   switch (addr) {
     case 0xFF40:
@@ -155,267 +284,109 @@ void Ppu::write(uint16_t addr, uint8_t data) {
   }
 }
 
-void Ppu::drawLine() {
-  if (lcd_y >= 144) throw "Attempted to draw at invalid line";
-
-  drawBgLine();
-  drawWinLine();
-  drawObjLine();
+void Ppu::setRenderMode(RenderMode mode) {
+  if (mode == render_mode) return;
+  render_mode = mode;
+  resetRenderers();
 }
 
-// TODO: Factor some code out of this and drawWinLine
-void Ppu::drawBgLine() {
-  bool bg_win_enable = cgb_mode || (control & 1);
-  if (!bg_win_enable) return;
-
-  uint16_t tile_map_base = ((control >> 3) & 1) ? 0x9C00 : 0x9800;
-  uint16_t tile_row_index = (((lcd_y + scroll_y) / 8) % 32) * 32;
-  for (uint16_t tile_col = 0; tile_col < 21; tile_col++) {
-    uint16_t tile_col_index = (tile_col + (scroll_x / 8)) % 32;
-
-    bool signed_addressing = ((control >> 4) & 1) == 0;
-    uint16_t tile_data_base = signed_addressing ? 0x9000 : 0x8000;
-
-    uint8_t tile_index =
-        readVramBank0(tile_map_base + tile_row_index + tile_col_index);
-
-    uint8_t attrs = 0;
-    if (cgb_mode)
-      attrs = readVramBank1(tile_map_base + tile_row_index + tile_col_index);
-    bool y_flip = cgb_mode ? ((attrs >> 6) & 1) : false;
-    bool x_flip = cgb_mode ? ((attrs >> 5) & 1) : false;
-
-    uint16_t tile_start = static_cast<uint16_t>(
-        tile_data_base +
-        (signed_addressing ? static_cast<int8_t>(tile_index) : tile_index) *
-            16);
-    if (cgb_mode && ((attrs >> 3) & 1)) tile_start += 0x2000;
-
-    size_t left_x = tile_col * 8 - (scroll_x % 8);
-    uint16_t line_index = (lcd_y + scroll_y) % 8;
-    size_t line_n = y_flip ? 7 - line_index : line_index;
-    uint8_t least_sig_bits =
-        readVramBank0(static_cast<uint16_t>(tile_start + line_n * 2));
-    uint8_t most_sig_bits =
-        readVramBank0(static_cast<uint16_t>(tile_start + line_n * 2 + 1));
-
-    for (size_t pixel = 0; pixel < 8; pixel++) {
-      size_t pixel_num = x_flip ? pixel : 7 - pixel;
-      size_t pixel_index_x = left_x + pixel;
-      if (pixel_index_x >= 160) continue;
-
-      uint16_t color;
-      if (cgb_mode) {
-        uint8_t palette_num = attrs & 0b111;
-        uint8_t palette_i =
-            static_cast<uint8_t>(((most_sig_bits >> pixel_num) & 1) << 1) |
-            static_cast<uint8_t>((least_sig_bits >> pixel_num) & 1);
-        uint8_t color_i = palette_num * 8 + palette_i * 2;
-        color = static_cast<uint16_t>((cgb_bg_palette[color_i + 1]) << 8) |
-                cgb_bg_palette[color_i];
-      } else {
-        uint8_t palette_i =
-            static_cast<uint8_t>(((most_sig_bits >> (7 - pixel)) & 1) << 1) |
-            static_cast<uint8_t>((least_sig_bits >> (7 - pixel)) & 1);
-        uint8_t color_i = (dmg_bg_palette >> (palette_i * 2)) & 0b11;
-        color = dmg_colors[color_i];
-      }
-      framebuffer[lcd_y][pixel_index_x] = color;
-    }
+void Ppu::resetRenderers() {
+  // Destroying the worker finishes its pending lines first.
+  // A frame in progress in the old mode may be partly lost.
+  worker.reset();
+  deferred.reset();
+  check_frame.reset();
+  checked_lines.reset();
+  switch (render_mode) {
+    case RenderMode::kImmediate:
+      break;
+    case RenderMode::kWorker:
+      worker = std::make_unique<RenderWorker>(vram, oam, frames);
+      break;
+    case RenderMode::kDeferredChecked:
+      check_frame = std::make_unique<Frame>();
+      [[fallthrough]];
+    case RenderMode::kDeferred:
+      deferred = std::make_unique<DeferredRenderer>(vram, oam);
+      break;
   }
 }
 
-void Ppu::drawWinLine() {
+LineState Ppu::captureLineState() {
+  LineState state;
+  state.lcd_y = lcd_y;
+  state.control = control;
+  state.scroll_x = scroll_x;
+  state.scroll_y = scroll_y;
+  state.window_x = window_x;
+  state.window_y = window_y;
+  state.cgb_mode = cgb_mode;
+  state.dmg_bg_palette = dmg_bg_palette;
+  std::copy_n(dmg_obj_palette, 2, state.dmg_obj_palette);
+  std::copy_n(cgb_bg_palette, 64, state.cgb_bg_palette);
+  std::copy_n(cgb_obj_palette, 64, state.cgb_obj_palette);
+
   bool win_enable = (control >> 5) & 1;
   bool bg_win_enable = cgb_mode || (control & 1);
-  if (!win_enable || !bg_win_enable) return;
-  if (window_y > lcd_y || window_x > 166) return;
-
-  if (window_start_line == -1) window_start_line = lcd_y;
-
-  uint16_t tile_map_base = ((control >> 6) & 1) ? 0x9C00 : 0x9800;
-
-  uint16_t window_line =
-      static_cast<uint8_t>(window_start_line) + window_internal_line - window_y;
-
-  for (uint16_t tile_col = 0; tile_col < 21; tile_col++) {
-    uint16_t tile_row_index = (window_line / 8) * 32;
-    uint16_t tile_col_index = tile_col;
-
-    bool signed_addressing = ((control >> 4) & 1) == 0;
-    uint16_t tile_data_base = signed_addressing ? 0x9000 : 0x8000;
-
-    uint8_t tile_index =
-        readVramBank0(tile_map_base + tile_row_index + tile_col_index);
-
-    uint8_t attrs = 0;
-    if (cgb_mode)
-      attrs = readVramBank1(tile_map_base + tile_row_index + tile_col_index);
-    bool y_flip = cgb_mode ? ((attrs >> 6) & 1) : false;
-    bool x_flip = cgb_mode ? ((attrs >> 5) & 1) : false;
-
-    uint16_t tile_start = static_cast<uint16_t>(
-        tile_data_base +
-        (signed_addressing ? static_cast<int8_t>(tile_index) : tile_index) *
-            16);
-    if (cgb_mode && ((attrs >> 3) & 1)) tile_start += 0x2000;
-
-    size_t left_x = tile_col * 8 + (window_x - 7);
-    uint16_t line_index = window_line % 8;
-    size_t line_n = y_flip ? 7 - line_index : line_index;
-    uint8_t least_sig_bits =
-        readVramBank0(static_cast<uint16_t>(tile_start + line_n * 2));
-    uint8_t most_sig_bits =
-        readVramBank0(static_cast<uint16_t>(tile_start + line_n * 2 + 1));
-
-    for (size_t pixel = 0; pixel < 8; pixel++) {
-      size_t pixel_num = x_flip ? pixel : 7 - pixel;
-      size_t pixel_index_x = left_x + pixel;
-      if (pixel_index_x >= 160) continue;
-
-      uint16_t color;
-      if (cgb_mode) {
-        uint8_t palette_num = attrs & 0b111;
-        uint8_t palette_i =
-            static_cast<uint8_t>(((most_sig_bits >> pixel_num) & 1) << 1) |
-            static_cast<uint8_t>((least_sig_bits >> pixel_num) & 1);
-        uint8_t color_i = palette_num * 8 + palette_i * 2;
-        color = static_cast<uint16_t>((cgb_bg_palette[color_i + 1]) << 8) |
-                cgb_bg_palette[color_i];
-      } else {
-        uint8_t palette_i =
-            static_cast<uint8_t>(((most_sig_bits >> (7 - pixel)) & 1) << 1) |
-            static_cast<uint8_t>((least_sig_bits >> (7 - pixel)) & 1);
-        uint8_t color_i = (dmg_bg_palette >> (palette_i * 2)) & 0b11;
-        color = dmg_colors[color_i];
-      }
-      framebuffer[lcd_y][pixel_index_x] = color;
-    }
+  state.window_visible = win_enable && bg_win_enable && window_y <= lcd_y &&
+                         window_x <= 166;
+  if (state.window_visible && window_start_line == -1) {
+    window_start_line = lcd_y;
   }
+  state.window_line = static_cast<uint16_t>(
+      static_cast<uint8_t>(window_start_line) + window_internal_line -
+      window_y);
+  if (state.window_visible) window_internal_line++;
 
-  window_internal_line++;
+  return state;
 }
 
-void Ppu::drawObjLine() {
-  bool obj_enable = (control >> 1) & 1;
-  if (!obj_enable) return;
-
-  std::vector<OamEntry> selected;
-  selected.reserve(10);
-
-  const bool large_obj = (control >> 2) & 1;
-  const uint8_t height = large_obj ? 16 : 8;
-  for (size_t oam_index = 0; oam_index < 40; oam_index++) {
-    uint8_t y = oam[oam_index * 4 + 0];
-    int16_t y_signed = static_cast<int16_t>(y) - 16;
-    if (lcd_y >= y_signed && lcd_y < y_signed + height) {
-      uint8_t x = oam[oam_index * 4 + 1];
-      uint8_t tile_index = oam[oam_index * 4 + 2];
-      uint8_t attrs = oam[oam_index * 4 + 3];
-      selected.push_back({y, x, tile_index, attrs});
-
-      if (selected.size() >= 10) break;
+void Ppu::drawLine() {
+  if (lcd_y >= 144) throw "Attempted to draw at invalid line";
+
+  // The window's line counter has to advance even on skipped frames
+  const LineState state = captureLineState();
+  if (!rendering || frames_until_render > 0) return;
+
+  if (worker) {
+    worker->drawLine(state);
+  } else if (deferred) {
+    deferred->drawLine(state);
+    if (check_frame) {
+      renderer.updateSprites();
+      renderer.drawLine(state, (*check_frame)[lcd_y]);
+      checked_lines.set(lcd_y);
     }
+  } else {
+    renderer.updateSprites();
+    renderer.drawLine(state, frames.getBack()[lcd_y]);
   }
+}
 
-  // In Non-CGB mode, the smaller the X coordinate, the higher the priority.
-  // When X coordinates are identical, the object located first in OAM has
-  // higher priority.
-  // In CGB mode, only the object’s location in OAM determines its priority. The
-  // earlier the object, the higher its priority.
-  if (!cgb_mode) {
-    std::stable_sort(selected.begin(), selected.end(),
-                     [](auto a, auto b) { return a.x < b.x; });
+void Ppu::endFrame() {
+  const bool render = rendering && frames_until_render == 0;
+  if (rendering) {
+    frames_until_render = render ? frame_skip : frames_until_render - 1;
   }
 
-  // Iterate backwards so the highest-priority sprites are drawn on top
-  for (auto it = selected.rbegin(); it != selected.rend(); it++) {
-    const auto [y, x, tile_index, attrs] = *it;
-
-    if (x == 0 || x >= 168) continue;
-
-    bool bg_win_over_obj = (!cgb_mode || (control & 1)) && ((attrs >> 7) & 1);
-    bool y_flip = (attrs >> 6) & 1;
-    bool x_flip = (attrs >> 5) & 1;
-    uint8_t palette_num = cgb_mode ? (attrs & 0b111) : ((attrs >> 4) & 1);
-
-    int16_t x_signed = static_cast<int16_t>(x) - 8;
-    int16_t y_signed = static_cast<int16_t>(y) - 16;
-    uint8_t line_index =
-        static_cast<uint8_t>(static_cast<int16_t>(lcd_y) - y_signed);
-    uint8_t tile_to_draw = it->tile_index;
-    if (large_obj) {
-      tile_to_draw &= ~1;
-      if (line_index >= 8) {
-        tile_to_draw |= 1;
-        line_index -= 8;
-      }
-
-      if (y_flip) tile_to_draw ^= 1;
-    }
-
-    uint16_t tile_start = 0x8000 + tile_to_draw * 16;
-    if (cgb_mode && ((attrs >> 3) & 1)) tile_start += 0x2000;
-
-    size_t line_n = y_flip ? 7 - line_index : line_index;
-    uint8_t least_sig_bits =
-        readVramBank0(static_cast<uint16_t>(tile_start + line_n * 2));
-    uint8_t most_sig_bits =
-        readVramBank0(static_cast<uint16_t>(tile_start + line_n * 2 + 1));
-
-    for (size_t pixel = 0; pixel < 8; pixel++) {
-      size_t pixel_index_x =
-          static_cast<size_t>(x_signed + static_cast<int>(pixel));
-      if (pixel_index_x >= 160) continue;
-
-      if (bg_win_over_obj) {
-        uint16_t bg_color_0 =
-            cgb_mode ? static_cast<uint16_t>((cgb_bg_palette[1] << 8) |
-                                             cgb_bg_palette[0])
-                     : dmg_colors[dmg_bg_palette & 0b11];
-        if (framebuffer[lcd_y][pixel_index_x] != bg_color_0) continue;
-      }
+  if (deferred) deferred->endFrame(frames.getBack(), render);
+  if (!render) return;
 
-      // TODO: Confirm this is right
-      // Respect the CGBA BG attr bit 7 "BG-to-OAM Priority"
-      // If the BG tile that overlaps this pixel has it set, hide the pixel
-      if (cgb_mode) {
-        uint16_t bg_tile_map_base = ((control >> 3) & 1) ? 0x9C00 : 0x9800;
-        uint16_t bg_tile_row_index = (((lcd_y + scroll_y) / 8) % 32) * 32;
-        uint16_t bg_tile_col_index =
-            ((pixel_index_x / 8) + (scroll_x / 8)) % 32;
-        uint8_t bg_tile_attrs = readVramBank1(
-            bg_tile_map_base + bg_tile_row_index + bg_tile_col_index);
-        if (bg_tile_attrs >> 7) continue;
-
-        // Also check the window
-        uint16_t window_line = static_cast<uint8_t>(window_start_line) +
-                               window_internal_line - window_y;
-
-        bg_tile_row_index = (window_line / 8) * 32;
-        bg_tile_col_index = static_cast<uint16_t>(pixel_index_x / 8);
-        bg_tile_map_base = ((control >> 6) & 1) ? 0x9C00 : 0x9800;
-        bg_tile_attrs = readVramBank1(bg_tile_map_base + bg_tile_row_index +
-                                      bg_tile_col_index);
-        if (bg_tile_attrs >> 7) continue;
+  if (check_frame) {
+    for (size_t y = 0; y < 144; y++) {
+      if (checked_lines[y] && (*check_frame)[y] != frames.getBack()[y]) {
+        mismatched_frames++;
+        std::cerr << "Deferred rendering differs from immediate at line " << y
+                  << std::endl;
+        break;
       }
-
-      size_t pixel_num = x_flip ? pixel : 7 - pixel;
-      uint8_t palette_i =
-          static_cast<uint8_t>(((most_sig_bits >> pixel_num) & 1) << 1) |
-          static_cast<uint8_t>((least_sig_bits >> pixel_num) & 1);
-      if (palette_i == 0) continue;
-      uint16_t color;
-      if (cgb_mode) {
-        uint8_t color_i = palette_num * 8 + palette_i * 2;
-        color = static_cast<uint16_t>((cgb_obj_palette[color_i + 1]) << 8) |
-                cgb_obj_palette[color_i];
-      } else {
-        uint8_t color_i =
-            (dmg_obj_palette[palette_num] >> (palette_i * 2)) & 0b11;
-        color = dmg_colors[color_i];
-      }
-      framebuffer[lcd_y][pixel_index_x] = color;
     }
+    checked_lines.reset();
+  }
+
+  if (worker) {
+    worker->endFrame();
+  } else {
+    frames.publish();
   }
 }
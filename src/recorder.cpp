@@ -0,0 +1,251 @@
+#include "recorder.h"
+
+#include <algorithm>
+#include <string_view>
+
+namespace {
+
+const uint32_t kWavHeaderSize = 44;
+
+void writeLE(std::ostream &out, uint32_t value, int n_bytes) {
+  for (int i = 0; i < n_bytes; i++) {
+    out.put(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+
+}  // namespace
+
+Recorder::Recorder()
+    : jobs(),
+      current(kBuffers),
+      y4m(false),
+      width(0),
+      height(0),
+      audio_bytes(0),
+      bad_deltas(0) {
+  for (uint32_t i = 0; i < kBuffers; i++) free_jobs.push(i);
+  thread = std::thread(&Recorder::run, this);
+}
+
+Recorder::~Recorder() { close(); }
+
+std::optional<std::string> Recorder::openVideo(const std::string &filename,
+                                               size_t width_, size_t height_,
+                                               uint64_t rate_num,
+                                               uint64_t rate_den) {
+  video.open(filename, std::ios::binary);
+  if (video.fail()) {
+    return "Failed to open file: " + filename;
+  }
+  width = width_;
+  height = height_;
+
+  y4m = filename.ends_with(".y4m");
+  if (y4m) {
+    video << "YUV4MPEG2 W" << width << " H" << height << " F" << rate_num
+          << ':' << rate_den << " Ip A1:1 C444\n";
+  }
+  return {};
+}
+
+std::optional<std::string> Recorder::openAudio(const std::string &filename,
+                                               int sample_rate) {
+  audio.open(filename, std::ios::binary);
+  if (audio.fail()) {
+    return "Failed to open file: " + filename;
+  }
+
+  // The sizes are filled in once they're known
+  const uint32_t rate = static_cast<uint32_t>(sample_rate);
+  audio << "RIFF";
+  writeLE(audio, 0, 4);
+  audio << "WAVEfmt ";
+  writeLE(audio, 16, 4);        // Format chunk size
+  writeLE(audio, 1, 2);         // PCM
+  writeLE(audio, 2, 2);         // Channels
+  writeLE(audio, rate, 4);      // Sample rate
+  writeLE(audio, rate * 4, 4);  // Bytes per second
+  writeLE(audio, 4, 2);         // Bytes per frame
+  writeLE(audio, 16, 2);        // Bits per sample
+  audio << "data";
+  writeLE(audio, 0, 4);
+  return {};
+}
+
+std::optional<std::string> Recorder::openFrameDeltas(
+    const std::string &filename) {
+  deltas.open(filename, std::ios::binary);
+  if (deltas.fail()) {
+    return "Failed to open file: " + filename;
+  }
+  return {};
+}
+
+uint32_t *Recorder::beginFrame() {
+  if (current == kBuffers) current = acquireJob();
+  jobs[current].pixels.resize(width * height);
+  return jobs[current].pixels.data();
+}
+
+void Recorder::submitFrame() { submitJob(Job::Type::kFrame); }
+
+void Recorder::repeatFrame() {
+  current = acquireJob();
+  submitJob(Job::Type::kRepeat);
+}
+
+void Recorder::writeAudio(const int16_t *samples, size_t n_frames) {
+  current = acquireJob();
+  jobs[current].samples.assign(samples, samples + 2 * n_frames);
+  submitJob(Job::Type::kAudio);
+}
+
+void Recorder::writeFrameDelta(const PublishedFrame &frame) {
+  current = acquireJob();
+  Job &job = jobs[current];
+  if (!job.frame) job.frame = std::make_unique<PublishedFrame>();
+  *job.frame = frame;
+  submitJob(Job::Type::kFrameDelta);
+}
+
+std::optional<std::string> Recorder::close() {
+  if (!thread.joinable()) return {};
+  current = acquireJob();
+  submitJob(Job::Type::kStop);
+  thread.join();
+
+  if (audio.is_open()) finishWav();
+  const bool failed = (video.is_open() && video.fail()) ||
+                      (audio.is_open() && audio.fail()) ||
+                      (deltas.is_open() && deltas.fail());
+  video.close();
+  audio.close();
+  deltas.close();
+  if (failed) {
+    return "Failed to write recording";
+  }
+  if (bad_deltas > 0) {
+    return std::to_string(bad_deltas) +
+           " frame deltas didn't decode to their frames";
+  }
+  return {};
+}
+
+uint32_t Recorder::acquireJob() {
+  while (true) {
+    // Read the count before popping so a push in between can't be missed
+    const uint64_t pushed = free_jobs.pushedCount();
+    uint32_t index;
+    if (free_jobs.pop(index)) return index;
+    free_jobs.waitForPush(pushed);
+  }
+}
+
+void Recorder::submitJob(Job::Type type) {
+  jobs[current].type = type;
+  // Only kBuffers jobs exist, so there's always room
+  ready_jobs.push(current);
+  ready_jobs.notifyPush();
+  current = kBuffers;
+}
+
+void Recorder::run() {
+  while (true) {
+    const uint64_t pushed = ready_jobs.pushedCount();
+    uint32_t index;
+    if (!ready_jobs.pop(index)) {
+      ready_jobs.waitForPush(pushed);
+      continue;
+    }
+
+    Job &job = jobs[index];
+    switch (job.type) {
+      case Job::Type::kFrame:
+        writeFrame(job.pixels);
+        break;
+      case Job::Type::kRepeat:
+        video.write(reinterpret_cast<const char *>(frame_bytes.data()),
+                    static_cast<std::streamsize>(frame_bytes.size()));
+        break;
+      case Job::Type::kAudio:
+        writeSamples(job.samples);
+        break;
+      case Job::Type::kFrameDelta:
+        encodeFrameDelta(*job.frame);
+        break;
+      case Job::Type::kStop:
+        return;
+    }
+
+    free_jobs.push(index);
+    free_jobs.notifyPush();
+  }
+}
+
+void Recorder::writeFrame(const std::vector<uint32_t> &pixels) {
+  const size_t n = width * height;
+  if (y4m) {
+    // Planar BT.601 YCbCr at studio range, as players expect
+    const std::string_view header = "FRAME\n";
+    frame_bytes.resize(header.size() + 3 * n);
+    std::copy(header.begin(), header.end(), frame_bytes.begin());
+    uint8_t *y_plane = &frame_bytes[header.size()];
+    uint8_t *u_plane = y_plane + n;
+    uint8_t *v_plane = u_plane + n;
+    for (size_t i = 0; i < n; i++) {
+      const int r = (pixels[i] >> 16) & 0xFF;
+      const int g = (pixels[i] >> 8) & 0xFF;
+      const int b = pixels[i] & 0xFF;
+      y_plane[i] =
+          static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+      u_plane[i] = static_cast<uint8_t>(
+          ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+      v_plane[i] = static_cast<uint8_t>(
+          ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+  } else {
+    frame_bytes.resize(3 * n);
+    for (size_t i = 0; i < n; i++) {
+      frame_bytes[3 * i] = static_cast<uint8_t>(pixels[i] >> 16);
+      frame_bytes[3 * i + 1] = static_cast<uint8_t>(pixels[i] >> 8);
+      frame_bytes[3 * i + 2] = static_cast<uint8_t>(pixels[i]);
+    }
+  }
+  video.write(reinterpret_cast<const char *>(frame_bytes.data()),
+              static_cast<std::streamsize>(frame_bytes.size()));
+}
+
+void Recorder::writeSamples(const std::vector<int16_t> &samples) {
+  sample_bytes.resize(2 * samples.size());
+  for (size_t i = 0; i < samples.size(); i++) {
+    const uint16_t sample = static_cast<uint16_t>(samples[i]);
+    sample_bytes[2 * i] = static_cast<uint8_t>(sample);
+    sample_bytes[2 * i + 1] = static_cast<uint8_t>(sample >> 8);
+  }
+  audio.write(reinterpret_cast<const char *>(sample_bytes.data()),
+              static_cast<std::streamsize>(sample_bytes.size()));
+  audio_bytes += sample_bytes.size();
+}
+
+void Recorder::encodeFrameDelta(const PublishedFrame &frame) {
+  delta_bytes.clear();
+  encoder.encode(frame, delta_bytes);
+  if (decoder.apply(delta_bytes.data(), delta_bytes.size()) ||
+      decoder.getFrame() != frame.pixels) {
+    bad_deltas++;
+  }
+  writeLE(deltas, static_cast<uint32_t>(delta_bytes.size()), 4);
+  deltas.write(reinterpret_cast<const char *>(delta_bytes.data()),
+               static_cast<std::streamsize>(delta_bytes.size()));
+}
+
+void Recorder::finishWav() {
+  // Sizes are 32-bit, so a recording over ~6 hours can't describe itself;
+  // most players cope with the data running past the stated size
+  const uint32_t data_size = static_cast<uint32_t>(
+      std::min<uint64_t>(audio_bytes, UINT32_MAX - kWavHeaderSize));
+  audio.seekp(4);
+  writeLE(audio, data_size + kWavHeaderSize - 8, 4);
+  audio.seekp(40);
+  writeLE(audio, data_size, 4);
+}
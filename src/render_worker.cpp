@@ -0,0 +1,102 @@
+#include "render_worker.h"
+
+RenderWorker::RenderWorker(const std::array<uint8_t, kVramSize> &vram_,
+                           const std::array<uint8_t, kOamSize> &oam_,
+                           FramePublisher &frames_)
+    : vram(vram_),
+      oam(oam_),
+      renderer(vram, oam),
+      frames(frames_),
+      journal_applied(0),
+      jobs_done(0) {
+  thread = std::thread(&RenderWorker::run, this);
+}
+
+RenderWorker::~RenderWorker() {
+  pushJob(Job::Type::kStop);
+  thread.join();
+}
+
+void RenderWorker::drawLine(const LineState &state) {
+  pushJob(Job::Type::kLine, state);
+}
+
+void RenderWorker::endFrame() { pushJob(Job::Type::kFrameEnd); }
+
+void RenderWorker::finish() {
+  pushJob(Job::Type::kSync);
+  const uint64_t target = jobs.pushedCount();
+  uint64_t done = jobs_done.load(std::memory_order_acquire);
+  while (done < target) {
+    jobs_done.wait(done);
+    done = jobs_done.load(std::memory_order_acquire);
+  }
+}
+
+void RenderWorker::reload(const std::array<uint8_t, kVramSize> &vram_,
+                          const std::array<uint8_t, kOamSize> &oam_) {
+  // Once finished, the journal is empty and the worker is waiting for a job,
+  // which it will pop after these copies
+  finish();
+  vram = vram_;
+  oam = oam_;
+  renderer.invalidateSprites();
+}
+
+void RenderWorker::journalWrite(MemoryWrite write) {
+  if (journal.push(write)) return;
+
+  // The journal only drains as jobs are processed, so when it fills up
+  // (e.g. VRAM being loaded with the LCD off) ask the worker to catch up
+  pushJob(Job::Type::kSync);
+  while (!journal.push(write)) std::this_thread::yield();
+}
+
+void RenderWorker::pushJob(Job::Type type, const LineState &state) {
+  const Job job{type, journal.pushedCount(), state};
+  while (!jobs.push(job)) std::this_thread::yield();
+  jobs.notifyPush();
+}
+
+void RenderWorker::applyJournal(uint64_t journal_end) {
+  MemoryWrite write;
+  while (journal_applied < journal_end && journal.pop(write)) {
+    if (write.index & kOamFlag) {
+      oam[write.index & (kOamFlag - 1)] = write.data;
+      renderer.invalidateSprites();
+    } else {
+      vram[write.index] = write.data;
+    }
+    journal_applied++;
+  }
+}
+
+void RenderWorker::run() {
+  while (true) {
+    // Read the count before popping so a push in between can't be missed
+    const uint64_t pushed = jobs.pushedCount();
+    Job job;
+    if (!jobs.pop(job)) {
+      jobs.waitForPush(pushed);
+      continue;
+    }
+
+    applyJournal(job.journal_end);
+    switch (job.type) {
+      case Job::Type::kLine:
+        renderer.updateSprites();
+        renderer.drawLine(job.state, frames.getBack()[job.state.lcd_y]);
+        break;
+      case Job::Type::kFrameEnd:
+        frames.publish();
+        break;
+      case Job::Type::kSync:
+        break;
+      case Job::Type::kStop:
+        return;
+    }
+
+    jobs_done.fetch_add(1, std::memory_order_release);
+    jobs_done.notify_all();
+  }
+}
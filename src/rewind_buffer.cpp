@@ -0,0 +1,75 @@
+#include "rewind_buffer.h"
+
+#include <cstring>
+
+#include "state_delta.h"
+
+RewindBuffer::RewindBuffer(size_t budget_bytes)
+    : ring(budget_bytes), head(0), has_newest(false) {}
+
+void RewindBuffer::push(const std::vector<uint8_t> &state) {
+  if (has_newest && state.size() != newest.size()) clear();
+  if (!has_newest) {
+    newest = state;
+    has_newest = true;
+    return;
+  }
+
+  encodeDelta(newest.data(), state.data(), state.size(), scratch);
+  if (scratch.size() > ring.size()) {
+    // Too big to keep any history at all
+    entries.clear();
+    head = 0;
+  } else {
+    const size_t offset = allocate(scratch.size());
+    std::memcpy(ring.data() + offset, scratch.data(), scratch.size());
+    entries.push_back({offset, scratch.size()});
+    head = offset + scratch.size();
+  }
+  std::memcpy(newest.data(), state.data(), state.size());
+}
+
+bool RewindBuffer::pop(std::vector<uint8_t> &out) {
+  if (!has_newest) return false;
+  out = newest;
+
+  if (entries.empty()) {
+    has_newest = false;
+    return true;
+  }
+  const Entry entry = entries.back();
+  entries.pop_back();
+  applyDelta(ring.data() + entry.offset, entry.size, newest.data(),
+             newest.size());
+  head = entry.offset;
+  return true;
+}
+
+void RewindBuffer::clear() {
+  entries.clear();
+  head = 0;
+  has_newest = false;
+}
+
+size_t RewindBuffer::bytesUsed() const {
+  size_t total = 0;
+  for (const Entry &entry : entries) total += entry.size;
+  return total;
+}
+
+size_t RewindBuffer::allocate(size_t size) {
+  size_t offset = head;
+  if (offset + size > ring.size()) {
+    // Deltas are contiguous, so the end of the ring goes unused this time
+    // round, and whatever is still there is the oldest history
+    while (!entries.empty() && entries.front().offset >= head) {
+      entries.pop_front();
+    }
+    offset = 0;
+  }
+  while (!entries.empty() && entries.front().offset < offset + size &&
+         entries.front().offset + entries.front().size > offset) {
+    entries.pop_front();
+  }
+  return offset;
+}
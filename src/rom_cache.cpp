@@ -0,0 +1,62 @@
+#include "rom_cache.h"
+
+#include <system_error>
+
+RomCache &RomCache::shared() {
+  static RomCache cache;
+  return cache;
+}
+
+std::variant<std::shared_ptr<const RomImage>, std::string> RomCache::load(
+    const std::string &filename) {
+  // Anything that can't be resolved or stat'ed just isn't cached by path,
+  // and loading it will report the error
+  std::error_code error;
+  const std::filesystem::path path(filename);
+  std::string key = std::filesystem::weakly_canonical(path, error).string();
+  if (error) key.clear();
+  const uintmax_t file_size = std::filesystem::file_size(path, error);
+  if (error) key.clear();
+  const auto modified = std::filesystem::last_write_time(path, error);
+  if (error) key.clear();
+
+  std::lock_guard lock(mutex);
+  if (!key.empty()) {
+    auto it = by_path.find(key);
+    if (it != by_path.end() && it->second.file_size == file_size &&
+        it->second.modified == modified) {
+      if (auto image = it->second.image.lock()) return image;
+    }
+  }
+
+  auto result = RomImage::load(filename);
+  if (std::holds_alternative<std::string>(result)) return result;
+  std::shared_ptr<const RomImage> image = std::get<0>(result);
+
+  // Reuse an identical image loaded from another path, or a previous version
+  // of this file if it was only touched
+  auto &shared_image = by_hash[image->getHash()];
+  if (auto existing = shared_image.lock();
+      existing && existing->size() == image->size()) {
+    image = existing;
+  } else {
+    shared_image = image;
+  }
+  if (!key.empty()) by_path[key] = {file_size, modified, image};
+
+  prune();
+  return image;
+}
+
+size_t RomCache::size() {
+  std::lock_guard lock(mutex);
+  prune();
+  return by_hash.size();
+}
+
+void RomCache::prune() {
+  std::erase_if(by_path,
+                [](const auto &entry) { return entry.second.image.expired(); });
+  std::erase_if(by_hash,
+                [](const auto &entry) { return entry.second.expired(); });
+}
@@ -0,0 +1,150 @@
+#include "save_file.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+#include <utility>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Writes data to filename, replacing it, and waits for it to reach the disk
+bool writeDurably(const std::string &filename,
+                  const std::vector<uint8_t> &data) {
+#ifdef _WIN32
+  std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(data.data()),
+            static_cast<std::streamsize>(data.size()));
+  out.close();
+  return !out.fail();
+#else
+  const int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) return false;
+  size_t written = 0;
+  while (written < data.size()) {
+    const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+    if (n < 0) {
+      close(fd);
+      return false;
+    }
+    written += static_cast<size_t>(n);
+  }
+  const bool synced = fsync(fd) == 0;
+  return close(fd) == 0 && synced;
+#endif
+}
+
+// Waits for a rename into the file's directory to reach the disk
+void syncDirectory(const std::string &filename) {
+#ifndef _WIN32
+  const std::filesystem::path parent =
+      std::filesystem::path(filename).parent_path();
+  const std::filesystem::path directory = parent.empty() ? "." : parent;
+  const int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) return;
+  fsync(fd);
+  close(fd);
+#else
+  (void)filename;
+#endif
+}
+
+}  // namespace
+
+SaveFile::SaveFile(std::string filename_, size_t ram_size)
+    : filename(std::move(filename_)),
+      dirty_banks((ram_size + kBankSize - 1) / kBankSize, false),
+      dirty(false),
+      replaced(false),
+      last_flush(),
+      shadow(),
+      pending(false),
+      stop(false) {}
+
+SaveFile::~SaveFile() {
+  {
+    std::lock_guard lock(mutex);
+    stop = true;
+  }
+  cond.notify_one();
+  if (thread.joinable()) thread.join();
+}
+
+std::vector<uint8_t> SaveFile::load() {
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  std::vector<uint8_t> data;
+  if (file) {
+    data.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char *>(data.data()),
+              static_cast<std::streamsize>(data.size()));
+    data.resize(static_cast<size_t>(file.gcount()));
+  }
+
+  std::lock_guard lock(mutex);
+  shadow = data;
+  return data;
+}
+
+void SaveFile::flush(const PagedMemory<kBankSize> &ram,
+                     const std::vector<uint8_t> &trailer, bool force) {
+  if (!isFlushDue(force)) return;
+  last_flush = std::chrono::steady_clock::now();
+  dirty = false;
+
+  {
+    std::lock_guard lock(mutex);
+    const bool resized = shadow.size() != ram.size() + trailer.size();
+    shadow.resize(ram.size() + trailer.size());
+    for (size_t bank = 0; bank < ram.pageCount(); bank++) {
+      if (!resized && !dirty_banks[bank]) continue;
+      std::copy_n(ram.page(bank), kBankSize,
+                  shadow.begin() + static_cast<ptrdiff_t>(bank * kBankSize));
+    }
+    std::copy(trailer.begin(), trailer.end(),
+              shadow.begin() + static_cast<ptrdiff_t>(ram.size()));
+    pending = true;
+  }
+  std::fill(dirty_banks.begin(), dirty_banks.end(), false);
+
+  if (!thread.joinable()) thread = std::thread(&SaveFile::run, this);
+  cond.notify_one();
+}
+
+void SaveFile::run() {
+  std::unique_lock lock(mutex);
+  while (true) {
+    cond.wait(lock, [this] { return pending || stop; });
+    if (!pending) return;
+
+    // Write from a copy, so the emulation thread can update the shadow
+    // while the file is being written
+    const std::vector<uint8_t> data = shadow;
+    pending = false;
+    lock.unlock();
+    if (!write(data)) {
+      std::cerr << "Failed to write save file: " << filename << std::endl;
+    }
+    lock.lock();
+  }
+}
+
+bool SaveFile::write(const std::vector<uint8_t> &data) {
+  // The new contents are on disk before the rename, or a crash could leave
+  // the renamed file empty
+  const std::string temp_filename = filename + ".tmp";
+  if (!writeDurably(temp_filename, data)) return false;
+
+  // Replacing the file by renaming is atomic, so there's never a partial save
+  std::error_code error;
+  std::filesystem::rename(temp_filename, filename, error);
+  if (error) return false;
+  syncDirectory(filename);
+  return true;
+}
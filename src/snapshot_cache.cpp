@@ -0,0 +1,98 @@
+#include "snapshot_cache.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include "hash.h"
+#include "mapped_file.h"
+
+namespace {
+
+// Followed by the key (u64), the size of the extra data (u64), the extra
+// data and the state
+const char kSnapshotMagic[8] = {'D', 'O', 'D', 'O', 'S', 'N', 'A', 'P'};
+
+}  // namespace
+
+uint64_t SnapshotCache::makeKey(std::initializer_list<uint64_t> parts) {
+  Hasher hasher;
+  for (uint64_t part : parts) hasher.updateValue(part);
+  return hasher.digest();
+}
+
+bool SnapshotCache::load(uint64_t key, Gameboy &gameboy,
+                         std::vector<uint8_t> &extra) {
+  auto file_result = MappedFile::open(filename(key));
+  if (std::holds_alternative<std::string>(file_result)) return false;
+  const MappedFile &file = *std::get<0>(file_result);
+
+  StateReader reader(file.data(), file.size());
+  char magic[sizeof(kSnapshotMagic)];
+  uint64_t file_key, extra_size;
+  reader.read(magic, sizeof(magic));
+  reader.readValue(file_key);
+  reader.readValue(extra_size);
+  const uint8_t *extra_data = reader.take(extra_size);
+  if (!reader.ok() ||
+      std::memcmp(magic, kSnapshotMagic, sizeof(magic)) != 0 ||
+      file_key != key) {
+    return false;
+  }
+
+  const size_t state_size = reader.remaining();
+  if (gameboy.loadState(reader.take(state_size), state_size)) return false;
+  extra.assign(extra_data, extra_data + extra_size);
+  return true;
+}
+
+std::optional<std::string> SnapshotCache::store(
+    uint64_t key, Gameboy &gameboy, const std::vector<uint8_t> &extra) {
+  gameboy.saveState(state);
+
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+
+  // Runs sharing the cache may store the same snapshot at once, so each
+  // writes its own temporary file
+  const std::string final_filename = filename(key);
+  std::stringstream temp_filename;
+  temp_filename << final_filename << '.' << std::hex << std::random_device()()
+                << ".tmp";
+  {
+    std::ofstream out(temp_filename.str(), std::ios::binary | std::ios::trunc);
+    std::vector<uint8_t> header;
+    StateWriter writer(header);
+    writer.write(kSnapshotMagic, sizeof(kSnapshotMagic));
+    writer.writeValue(key);
+    const uint64_t extra_size = extra.size();
+    writer.writeValue(extra_size);
+    out.write(reinterpret_cast<const char *>(header.data()),
+              static_cast<std::streamsize>(header.size()));
+    out.write(reinterpret_cast<const char *>(extra.data()),
+              static_cast<std::streamsize>(extra.size()));
+    out.write(reinterpret_cast<const char *>(state.data()),
+              static_cast<std::streamsize>(state.size()));
+    out.close();
+    if (out.fail()) {
+      std::filesystem::remove(temp_filename.str(), error);
+      return "Couldn't write snapshot: " + final_filename;
+    }
+  }
+
+  std::filesystem::rename(temp_filename.str(), final_filename, error);
+  if (error) return "Couldn't write snapshot: " + final_filename;
+  return {};
+}
+
+std::string SnapshotCache::filename(uint64_t key) const {
+  std::stringstream sstream;
+  sstream << std::hex;
+  sstream.width(16);
+  sstream.fill('0');
+  sstream << key;
+  return (std::filesystem::path(directory) / (sstream.str() + ".snap"))
+      .string();
+}
@@ -0,0 +1,304 @@
+#include "state_archive.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "state_delta.h"
+
+namespace {
+
+const char kArchiveMagic[8] = {'D', 'O', 'D', 'O', 'A', 'R', 'C', 'H'};
+const char kIndexMagic[8] = {'D', 'O', 'D', 'O', 'A', 'I', 'D', 'X'};
+const uint32_t kArchiveVersion = 1;
+
+const uint8_t kKeyframe = 1;
+
+// Far more than any machine's state, so a larger size means corruption,
+// rather than something to allocate
+const uint64_t kMaxStateSize = 16 << 20;
+
+// The magic and version
+const size_t kHeaderSize = sizeof(kArchiveMagic) + sizeof(uint32_t);
+
+// The entry count, index offset and magic
+const size_t kFooterSize = 2 * sizeof(uint64_t) + sizeof(kIndexMagic);
+
+}  // namespace
+
+std::variant<std::unique_ptr<StateArchiveWriter>, std::string>
+StateArchiveWriter::create(const std::string &filename,
+                           int keyframe_interval) {
+  std::unique_ptr<StateArchiveWriter> writer(
+      new StateArchiveWriter(std::max(keyframe_interval, 1)));
+  writer->file.open(filename, std::ios::binary | std::ios::trunc);
+  if (!writer->file) return "Couldn't create archive: " + filename;
+
+  StateWriter header(writer->record);
+  header.write(kArchiveMagic, sizeof(kArchiveMagic));
+  header.writeValue(kArchiveVersion);
+  writer->writeBytes(writer->record);
+
+  writer->thread = std::thread(&StateArchiveWriter::run, writer.get());
+  return writer;
+}
+
+StateArchiveWriter::StateArchiveWriter(int keyframe_interval_)
+    : jobs(),
+      dropped(0),
+      keyframe_interval(keyframe_interval_),
+      offset(0) {
+  for (uint32_t i = 0; i < kBuffers; i++) free_jobs.push(i);
+}
+
+StateArchiveWriter::~StateArchiveWriter() { close(); }
+
+bool StateArchiveWriter::append(Gameboy &gameboy, uint64_t frame,
+                                const uint8_t *input, size_t input_size) {
+  uint32_t index_n;
+  if (!free_jobs.pop(index_n)) {
+    dropped++;
+    return false;
+  }
+  Job &job = jobs[index_n];
+  job.stop = false;
+  job.frame = frame;
+  gameboy.saveState(job.state);
+  job.input.assign(input, input + input_size);
+  submitJob(index_n);
+  return true;
+}
+
+std::optional<std::string> StateArchiveWriter::close() {
+  if (!thread.joinable()) return {};
+
+  // Unlike append, this waits for a buffer, as the writer is about to
+  // finish with one
+  uint32_t index_n;
+  while (true) {
+    const uint64_t pushed = free_jobs.pushedCount();
+    if (free_jobs.pop(index_n)) break;
+    free_jobs.waitForPush(pushed);
+  }
+  jobs[index_n].stop = true;
+  submitJob(index_n);
+  thread.join();
+
+  writeIndex();
+  file.close();
+  if (file.fail()) return "Failed to write archive";
+  return {};
+}
+
+void StateArchiveWriter::submitJob(uint32_t job) {
+  // Only kBuffers jobs exist, so there's always room
+  ready_jobs.push(job);
+  ready_jobs.notifyPush();
+}
+
+void StateArchiveWriter::run() {
+  while (true) {
+    const uint64_t pushed = ready_jobs.pushedCount();
+    uint32_t index_n;
+    if (!ready_jobs.pop(index_n)) {
+      ready_jobs.waitForPush(pushed);
+      continue;
+    }
+
+    const Job &job = jobs[index_n];
+    const bool stop = job.stop;
+    if (!stop) writeEntry(job);
+    free_jobs.push(index_n);
+    free_jobs.notifyPush();
+    if (stop) return;
+  }
+}
+
+void StateArchiveWriter::writeEntry(const Job &job) {
+  const size_t size = job.state.size();
+  const bool keyframe =
+      index.size() % static_cast<size_t>(keyframe_interval) == 0 ||
+      size != last.size();
+  if (keyframe) {
+    zeroes.assign(size, 0);
+    encodeDelta(zeroes.data(), job.state.data(), size, delta);
+  } else {
+    encodeDelta(last.data(), job.state.data(), size, delta);
+  }
+  last = job.state;
+
+  StateWriter writer(record);
+  writer.writeValue(keyframe ? kKeyframe : uint8_t{0});
+  writer.writeValue(job.frame);
+  writer.writeVarint(size);
+  writer.writeVarint(job.input.size());
+  writer.write(job.input.data(), job.input.size());
+  writer.writeVarint(delta.size());
+  writeBytes(record);
+  writeBytes(delta);
+
+  // The header and the entry before were already written
+  index.push_back({job.frame, offset - record.size() - delta.size()});
+}
+
+void StateArchiveWriter::writeIndex() {
+  StateWriter writer(record);
+  const uint64_t index_offset = offset;
+  for (const IndexEntry &entry : index) {
+    writer.writeValue(entry.frame);
+    writer.writeValue(entry.offset);
+  }
+  const uint64_t count = index.size();
+  writer.writeValue(count);
+  writer.writeValue(index_offset);
+  writer.write(kIndexMagic, sizeof(kIndexMagic));
+  writeBytes(record);
+}
+
+void StateArchiveWriter::writeBytes(const std::vector<uint8_t> &bytes) {
+  file.write(reinterpret_cast<const char *>(bytes.data()),
+             static_cast<std::streamsize>(bytes.size()));
+  offset += bytes.size();
+}
+
+std::variant<std::unique_ptr<StateArchiveReader>, std::string>
+StateArchiveReader::open(const std::string &filename) {
+  auto file_result = MappedFile::open(filename);
+  if (std::holds_alternative<std::string>(file_result)) {
+    return std::get<std::string>(file_result);
+  }
+  std::unique_ptr<StateArchiveReader> reader(new StateArchiveReader());
+  reader->file = std::move(std::get<0>(file_result));
+
+  StateReader header(reader->file->data(), reader->file->size());
+  char magic[sizeof(kArchiveMagic)];
+  uint32_t version;
+  header.read(magic, sizeof(magic));
+  header.readValue(version);
+  if (!header.ok() ||
+      std::memcmp(magic, kArchiveMagic, sizeof(magic)) != 0) {
+    return "Not a state archive: " + filename;
+  }
+  if (version != kArchiveVersion) {
+    return "Unsupported state archive version: " + filename;
+  }
+
+  if (!reader->readIndex()) reader->scanEntries();
+  return reader;
+}
+
+std::optional<size_t> StateArchiveReader::find(uint64_t frame) const {
+  auto it = std::upper_bound(
+      entries.begin(), entries.end(), frame,
+      [](uint64_t f, const IndexEntry &entry) { return f < entry.frame; });
+  if (it == entries.begin()) return {};
+  return static_cast<size_t>(it - entries.begin()) - 1;
+}
+
+bool StateArchiveReader::readState(size_t n, std::vector<uint8_t> &out) const {
+  // Deltas are applied forwards from the keyframe at or before n
+  uint64_t frame;
+  Entry entry;
+  size_t end;
+  size_t key_n = n;
+  while (true) {
+    if (!parseEntry(entries[key_n].offset, frame, entry, end)) return false;
+    if (entry.keyframe) break;
+    if (key_n == 0) return false;
+    key_n--;
+  }
+
+  out.assign(entry.state_size, 0);
+  for (size_t i = key_n; i <= n; i++) {
+    if (i != key_n &&
+        (!parseEntry(entries[i].offset, frame, entry, end) ||
+         entry.state_size != out.size())) {
+      return false;
+    }
+    applyDelta(entry.delta, entry.delta_size, out.data(), out.size());
+  }
+  return true;
+}
+
+void StateArchiveReader::readInput(size_t n, std::vector<uint8_t> &out) const {
+  uint64_t frame;
+  Entry entry;
+  size_t end;
+  out.clear();
+  if (parseEntry(entries[n].offset, frame, entry, end)) {
+    out.assign(entry.input, entry.input + entry.input_size);
+  }
+}
+
+bool StateArchiveReader::readIndex() {
+  const size_t size = file->size();
+  if (size < kHeaderSize + kFooterSize) return false;
+  StateReader footer(file->data() + size - kFooterSize, kFooterSize);
+  uint64_t count, index_offset;
+  char magic[sizeof(kIndexMagic)];
+  footer.readValue(count);
+  footer.readValue(index_offset);
+  footer.read(magic, sizeof(magic));
+  const size_t index_size = size - kFooterSize - kHeaderSize;
+  if (std::memcmp(magic, kIndexMagic, sizeof(magic)) != 0 ||
+      index_offset < kHeaderSize || index_offset > size - kFooterSize ||
+      count > index_size / (2 * sizeof(uint64_t)) ||
+      index_offset + count * 2 * sizeof(uint64_t) != size - kFooterSize) {
+    return false;
+  }
+
+  StateReader reader(file->data() + index_offset, count * 2 * sizeof(uint64_t));
+  entries.resize(count);
+  for (IndexEntry &entry : entries) {
+    uint64_t entry_offset;
+    reader.readValue(entry.frame);
+    reader.readValue(entry_offset);
+    if (entry_offset >= index_offset) {
+      entries.clear();
+      return false;
+    }
+    entry.offset = entry_offset;
+  }
+  return true;
+}
+
+void StateArchiveReader::scanEntries() {
+  entries.clear();
+  size_t offset = kHeaderSize;
+  uint64_t frame;
+  Entry entry;
+  size_t end;
+  size_t state_size = 0;
+  while (parseEntry(offset, frame, entry, end)) {
+    // Without a per-entry marker, an archive cut off inside its index would
+    // have the index read as entries. Real entries start with a keyframe,
+    // all have the same state size, and have frame numbers that go up.
+    if (entries.empty()) {
+      if (!entry.keyframe) break;
+      state_size = entry.state_size;
+    } else if (entry.state_size != state_size ||
+               frame <= entries.back().frame) {
+      break;
+    }
+    entries.push_back({frame, offset});
+    offset = end;
+  }
+}
+
+bool StateArchiveReader::parseEntry(size_t offset, uint64_t &frame,
+                                    Entry &entry, size_t &end) const {
+  if (offset >= file->size()) return false;
+  StateReader reader(file->data() + offset, file->size() - offset);
+  uint8_t flags;
+  reader.readValue(flags);
+  reader.readValue(frame);
+  entry.keyframe = flags & kKeyframe;
+  const uint64_t state_size = reader.readVarint();
+  if ((flags & ~kKeyframe) != 0 || state_size > kMaxStateSize) return false;
+  entry.state_size = state_size;
+  entry.input_size = reader.readVarint();
+  entry.input = reader.take(entry.input_size);
+  entry.delta_size = reader.readVarint();
+  entry.delta = reader.take(entry.delta_size);
+  end = file->size() - reader.remaining();
+  return reader.ok();
+}
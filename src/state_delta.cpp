@@ -0,0 +1,88 @@
+#include "state_delta.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Unchanged runs shorter than this are cheaper to carry in a literal than to
+// end it, as each run costs at least two bytes of lengths
+const size_t kMinRun = 4;
+
+void writeLength(std::vector<uint8_t> &out, size_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+size_t readLength(const uint8_t *&in, const uint8_t *end) {
+  size_t value = 0;
+  for (int shift = 0; in < end && shift < 64; shift += 7) {
+    const uint8_t byte = *in++;
+    value |= static_cast<size_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) break;
+  }
+  return value;
+}
+
+uint64_t load64(const uint8_t *p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Where the run of bytes equal in a and b starting at pos ends
+size_t skipEqual(const uint8_t *a, const uint8_t *b, size_t pos, size_t size) {
+  while (pos + 8 <= size && load64(a + pos) == load64(b + pos)) pos += 8;
+  while (pos < size && a[pos] == b[pos]) pos++;
+  return pos;
+}
+
+}  // namespace
+
+void encodeDelta(const uint8_t *a, const uint8_t *b, size_t size,
+                 std::vector<uint8_t> &out) {
+  out.clear();
+  size_t pos = 0;
+  while (pos < size) {
+    const size_t run_start = pos;
+    pos = skipEqual(a, b, pos, size);
+    const size_t run = pos - run_start;
+
+    // Extend the literal until a long enough unchanged run
+    const size_t literal_start = pos;
+    while (pos < size) {
+      if (a[pos] != b[pos]) {
+        pos++;
+        continue;
+      }
+      const size_t equal_end = skipEqual(a, b, pos, size);
+      if (equal_end - pos >= kMinRun || equal_end == size) break;
+      pos = equal_end;
+    }
+
+    writeLength(out, run);
+    writeLength(out, pos - literal_start);
+    for (size_t i = literal_start; i < pos; i++) {
+      out.push_back(static_cast<uint8_t>(a[i] ^ b[i]));
+    }
+  }
+}
+
+void applyDelta(const uint8_t *delta, size_t delta_size, uint8_t *state,
+                size_t size) {
+  const uint8_t *in = delta;
+  const uint8_t *end = delta + delta_size;
+  size_t pos = 0;
+  while (in < end) {
+    pos += readLength(in, end);
+    const size_t literal =
+        std::min(readLength(in, end), static_cast<size_t>(end - in));
+    const size_t n = std::min(literal, size - std::min(pos, size));
+    for (size_t i = 0; i < n; i++) state[pos + i] ^= in[i];
+    in += literal;
+    pos += literal;
+  }
+}
@@ -0,0 +1,78 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t n_threads) : stopping(false) {
+  for (size_t i = 0; i < n_threads; i++) {
+    threads.emplace_back(&ThreadPool::run, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  work_cv.notify_all();
+  for (auto &thread : threads) thread.join();
+}
+
+ThreadPool &ThreadPool::shared() {
+  static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 1u) -
+                         1);
+  return pool;
+}
+
+void ThreadPool::parallelFor(size_t n, size_t n_chunks,
+                             const std::function<void(size_t, size_t)> &func) {
+  n_chunks = std::min(n_chunks, n);
+  if (n_chunks <= 1 || threads.empty()) {
+    if (n > 0) func(0, n);
+    return;
+  }
+
+  Batch batch{func, n, n_chunks, 0, 0};
+  std::unique_lock<std::mutex> lock(mutex);
+  batches.push_back(&batch);
+  work_cv.notify_all();
+
+  // Help out until every chunk is claimed, then wait for the stragglers
+  while (batch.next_chunk < batch.n_chunks) {
+    auto [claimed, chunk] = claimChunk();
+    runChunk(lock, *claimed, chunk);
+  }
+  done_cv.wait(lock, [&] { return batch.done_chunks == batch.n_chunks; });
+}
+
+std::pair<ThreadPool::Batch *, size_t> ThreadPool::claimChunk() {
+  Batch *batch = batches.front();
+  size_t chunk = batch->next_chunk++;
+  if (batch->next_chunk == batch->n_chunks) batches.pop_front();
+  return {batch, chunk};
+}
+
+void ThreadPool::runChunk(std::unique_lock<std::mutex> &lock, Batch &batch,
+                          size_t chunk) {
+  size_t begin = batch.n * chunk / batch.n_chunks;
+  size_t end = batch.n * (chunk + 1) / batch.n_chunks;
+
+  lock.unlock();
+  batch.func(begin, end);
+  lock.lock();
+
+  // The batch lives on its submitter's stack, so it must not be touched
+  // after the last chunk is reported done
+  batch.done_chunks++;
+  if (batch.done_chunks == batch.n_chunks) done_cv.notify_all();
+}
+
+void ThreadPool::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    work_cv.wait(lock, [&] { return stopping || !batches.empty(); });
+    if (stopping) return;
+
+    auto [batch, chunk] = claimChunk();
+    runChunk(lock, *batch, chunk);
+  }
+}
@@ -1,35 +1,50 @@
 #include "timer.h"
 
-bool Timer::tick(int cpu_ticks) {
-  bool interrupt = false;
-
-  // The timer ticks every 256th CPU tick;
-  // cpu_tick_divider accumulates the leftover ticks
-  cpu_tick_divider += cpu_ticks;
-  while (cpu_tick_divider >= 256) {
-    divider++;
-    cpu_tick_divider -= 256;
+#include <algorithm>
+
+bool Timer::update(uint64_t now_) {
+  now = now_;
+  if (!enable) {
+    counter_time = now;
+    return false;
+  }
+
+  // Work out how many increments happened since counter_time, wrapping
+  // around to the modulo as many times as needed
+  const uint64_t total = counter_divider + (now - counter_time);
+  uint64_t increments = total / getClockStep();
+  counter_divider = total % getClockStep();
+  counter_time = now;
+
+  bool overflowed = false;
+  if (increments >= 256u - counter) {
+    increments -= 256u - counter;
+    const uint64_t period = 256u - modulo;
+    counter = static_cast<uint8_t>(modulo + increments % period);
+    overflowed = true;
+  } else {
+    counter = static_cast<uint8_t>(counter + increments);
   }
 
-  if (enable) {
-    counter_divider += cpu_ticks;
-    while (counter_divider >= getClockStep()) {
-      counter++;
-      if (counter == 0) {
-        counter = modulo;
-        interrupt = true;
-      }
-      counter_divider -= getClockStep();
-    }
+  if (overflowed) scheduleOverflow();
+  return overflowed;
+}
+
+void Timer::scheduleOverflow() {
+  if (!enable) {
+    next_overflow = kNever;
+    return;
   }
 
-  return interrupt;
+  const uint64_t ticks = (256u - counter) * getClockStep();
+  // counter_divider may exceed a step right after the clock is changed
+  next_overflow = counter_time + ticks - std::min(counter_divider, ticks);
 }
 
-uint8_t Timer::read(uint16_t addr) {
+uint8_t Timer::read(uint16_t addr) const {
   switch (addr) {
     case 0xFF04:
-      return divider;
+      return static_cast<uint8_t>((now - div_origin) >> 8);
     case 0xFF05:
       return counter;
     case 0xFF06:
@@ -43,7 +58,8 @@ uint8_t Timer::read(uint16_t addr) {
 void Timer::write(uint16_t addr, uint8_t data) {
   switch (addr) {
     case 0xFF04:
-      divider = 0;
+      // Resetting DIV keeps the ticks towards its next increment
+      div_origin = now - ((now - div_origin) & 0xFF);
       break;
     case 0xFF05:
       counter = data;
@@ -56,4 +72,40 @@ void Timer::write(uint16_t addr, uint8_t data) {
       clock_select = data & 0b11;
       break;
   }
+  scheduleOverflow();
+}
+
+void Timer::hashState(Hasher &hasher) const {
+  hasher.updateValue(now);
+  hasher.updateValue(div_origin);
+  hasher.updateValue(counter);
+  hasher.updateValue(modulo);
+  hasher.updateValue(counter_time);
+  hasher.updateValue(counter_divider);
+  hasher.updateValue(enable);
+  hasher.updateValue(clock_select);
+}
+
+void Timer::saveState(StateWriter &writer) const {
+  writer.writeValue(now);
+  writer.writeValue(div_origin);
+  writer.writeValue(counter);
+  writer.writeValue(modulo);
+  writer.writeValue(counter_time);
+  writer.writeValue(counter_divider);
+  writer.writeValue(enable);
+  writer.writeValue(clock_select);
+}
+
+void Timer::loadState(StateReader &reader) {
+  reader.readValue(now);
+  reader.readValue(div_origin);
+  reader.readValue(counter);
+  reader.readValue(modulo);
+  reader.readValue(counter_time);
+  reader.readValue(counter_divider);
+  reader.readValue(enable);
+  reader.readValue(clock_select);
+  clock_select &= 0b11;
+  scheduleOverflow();
 }